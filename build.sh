@@ -1,3 +1,4 @@
 #!/bin/sh
 
-cc -o fractabubbler main.c -g -lm -Wall
+cc -o fractabubbler main.c -g -lm -lpthread -Wall
+cc -o replay replay.c -g -lm -Wall
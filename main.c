@@ -16,6 +16,7 @@
 * the glyphs and performing a quadratic search through the bitmap repeatedly.
 */
 
+#define _GNU_SOURCE  // mremap
 #include <math.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -23,6 +24,17 @@
 #include <assert.h>
 #include <string.h>
 #include <time.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #define STB_TRUETYPE_IMPLEMENTATION  // force following include to generate implementation
 #include "stb_truetype.h"
 
@@ -31,6 +43,30 @@
 #define DEFAULT_FINENESS 4
 #define DEFAULT_HEIGHT 256
 
+/* How the biggest circle is searched for */
+typedef enum {
+    // Grow the radius one pixel at a time, testing each perimeter
+    ENGINE_PERIMETER,
+    // Binary search the radius over per-row prefix counts of empty pixels
+    ENGINE_PREFIX,
+    // Like ENGINE_PREFIX for the big circles, then fill the gaps between
+    // touching circles analytically
+    ENGINE_APOLLONIAN,
+    // Largest empty circles from a Voronoi diagram of the sampled outline
+    ENGINE_VORONOI,
+} Engine;
+
+/* The order circles are written in */
+typedef enum {
+    // Largest first, as they were placed
+    ORDER_RADIUS,
+    // Along a Hilbert curve within each radius band (halving of the radius),
+    // the bands largest first
+    ORDER_BAND,
+    // Along a Hilbert curve over the whole glyph
+    ORDER_GLOBAL,
+} SpatialOrder;
+
 typedef struct {
     const char *font;
     int glyph;
@@ -44,174 +80,3760 @@ typedef struct {
     // Image height
     int height;
 
-    bool debug_ascii_display;
-} Program;
+    // Search a grid this many times coarser than the height, placing circles
+    // with subpixel precision from the antialiased coverage (1 = off)
+    int oversample;
+
+    Engine engine;
+
+    // Fraction of a circle's area that may be uncovered by the glyph, summed
+    // over its antialiased coverage. 0 requires every pixel to be inside.
+    double tolerance;
+
+    // Minimum radius deep inside the glyph, ramping down to `fineness` at the
+    // outline over `fineness_ramp` pixels (0 = the same fineness everywhere)
+    int interior_fineness;
+    int fineness_ramp;
+
+    // ENGINE_APOLLONIAN: circles smaller than this are computed from the gaps
+    // between circles instead of searched for (0 = 3x the fineness)
+    int gap_radius;
+
+    // Largest radius (in pixels) a circle may have
+    // Defaults to MAX_CIRCLE_RADIUS_PERCENT of the height
+    int max_radius;
+
+    // Search the glyph in horizontal bands of this many rows, only keeping
+    // the band and the rows its circles can reach in memory (0 = whole glyph)
+    int band_height;
+
+    // Produce at most this many circles, optimized for coverage (0 = no budget)
+    int circles;
+
+    // Post-processing: move circles off the pixel grid towards the middle of
+    // their free space to grow them, then drop circles covering less than
+    // `prune` of the glyph
+    bool relax;
+    double prune;
+
+    // Search only one half of mirror-symmetric glyphs and mirror the circles.
+    // Up to `symmetry_tolerance` of the inside pixels may break the symmetry.
+    bool symmetry;
+    double symmetry_tolerance;
+
+    // Stop once this fraction of the glyph's inside area is covered by circles
+    // A value of 0 disables the check and relies on fineness alone
+    double target_coverage;
+
+    // Optional path to record the run to, for replay with ./replay
+    const char *event_log;
+
+    // Optional path to write a Chrome trace-event JSON file to
+    const char *trace_file;
+    // Only trace every nth search pass
+    int trace_sample;
+
+    // Write per-pixel search cost heatmaps next to the output
+    bool heatmap;
+
+    // Order of the written circles. Other than ORDER_RADIUS, every circle is
+    // written with its rank in the largest-first order.
+    SpatialOrder spatial_order;
+
+    // Threads searching a single glyph (prefix and apollonian engines)
+    int search_threads;
+
+    // Batch mode: megabytes the glyphs being worked on may use at once
+    // (0 = no limit)
+    int memory_limit;
+
+    // Batch mode: a comma separated list of presets, codepoints and ranges
+    // (instead of `glyph`), written to `out_dir` by `jobs` worker threads
+    const char *glyph_set;
+    const char *out_dir;
+    int jobs;
+
+    // Face of a font collection (.ttc) to use, or every face into its own
+    // directory under `out_dir`
+    int face;
+    bool all_faces;
+
+    // Batch mode over several fonts: a file listing font, glyph set, height,
+    // fineness and output directory per line
+    const char *manifest;
+
+    // Batch mode split over processes: render only shard `shard` (from 1) of
+    // `shard_count`, or merge the atlases of `merge_shards` finished shards
+    int shard;
+    int shard_count;
+    int merge_shards;
+
+    // Batch mode: write every output directory's circles into one binary
+    // atlas.bin instead of a file per glyph and the text atlas, with a grid
+    // of `atlas_grid` rows of square cells over each glyph (0 = none)
+    bool binary_atlas;
+    int atlas_grid;
+
+    // Batch mode: also hand every glyph's circles to another process through
+    // the named shared memory ring `publish` (`out_dir` becomes optional).
+    // `subscribe` reads such a ring instead of rendering.
+    const char *publish;
+    const char *subscribe;
+} Program;
+
+/* A greyscale bitmap */
+typedef struct {
+    uint8_t *data;
+    int stride;
+    int width;
+    int height;
+} Bitmap;
+
+/* Circles found by the raster search sit on whole pixels; post-processing
+* may move them off the grid */
+typedef struct {
+    double x, y, r;
+} Circle;
+
+/* Circles in the order they were placed (decreasing radius) */
+typedef struct {
+    Circle *items;
+    int count;
+    int capacity;
+} Circles;
+
+/* What fractabubble() made of a glyph, ready to be written out */
+typedef struct {
+    Circles circles;
+    int width;
+    int height;
+    char comment[64];  // how the circles were made, empty if nothing special
+    uint32_t *ranks;   // --spatial-order: each circle's place largest first
+} Bubbles;
+
+/* Search cost accumulated per pixel over a whole run */
+typedef struct {
+    uint32_t *probes;  // indexed by circle center
+    uint32_t *reads;   // indexed by the pixel read
+    int width;
+    int height;
+} HeatMap;
+
+/* Work done by the search while looking for one circle */
+typedef struct {
+    long probes;  // is_circle_in_image calls
+    long reads;   // bitmap bytes read
+    HeatMap *heat;  // optional
+} SearchStats;
+
+static inline int min(int a, int b) {
+    return a < b ? a : b;
+}
+
+static inline int max(int a, int b) {
+    return a > b ? a : b;
+}
+
+static void push_circle(Circles *circles, Circle circle) {
+    if (circles->count == circles->capacity) {
+        circles->capacity = circles->capacity ? circles->capacity * 2 : 64;
+        circles->items = realloc(circles->items, circles->capacity * sizeof(Circle));
+    }
+    circles->items[circles->count++] = circle;
+}
+
+/*
+* Chrome trace-event export (--trace). Spans are buffered per thread without
+* locking and written as one JSON array at exit, which chrome://tracing and
+* Perfetto show with one track per thread.
+*/
+typedef struct {
+    const char *name;
+    double start;     // microseconds since the trace epoch
+    double duration;
+    char args[64];    // JSON object body, may be empty
+} TraceEvent;
+
+typedef struct TraceBuffer {
+    struct TraceBuffer *next;
+    int tid;
+    char thread_name[32];
+    TraceEvent *events;
+    int count;
+    int capacity;
+} TraceBuffer;
+
+static bool tracing;
+static struct timespec trace_epoch;
+static _Atomic(TraceBuffer *) trace_buffers;
+static atomic_int trace_threads;
+static _Thread_local TraceBuffer *trace_buffer;
+
+static double trace_now(void) {
+    if (!tracing) return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - trace_epoch.tv_sec) * 1e6 + (now.tv_nsec - trace_epoch.tv_nsec) / 1e3;
+}
+
+static TraceBuffer *trace_this_thread(void) {
+    if (trace_buffer == NULL) {
+        trace_buffer = calloc(1, sizeof(TraceBuffer));
+        trace_buffer->tid = atomic_fetch_add(&trace_threads, 1) + 1;
+        snprintf(trace_buffer->thread_name, sizeof(trace_buffer->thread_name), "thread %d", trace_buffer->tid);
+        trace_buffer->next = atomic_load(&trace_buffers);
+        while (!atomic_compare_exchange_weak(&trace_buffers, &trace_buffer->next, trace_buffer));
+    }
+    return trace_buffer;
+}
+
+static void trace_thread_name(const char *fmt, ...) {
+    if (!tracing) return;
+    TraceBuffer *buffer = trace_this_thread();
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buffer->thread_name, sizeof(buffer->thread_name), fmt, ap);
+    va_end(ap);
+}
+
+// Record a span that started at `start` (from trace_now) and ends now.
+// `fmt` formats the body of the span's args object, e.g. "\"glyph\":%d".
+static void trace_span(const char *name, double start, const char *fmt, ...) {
+    if (!tracing) return;
+    const double end = trace_now();
+    TraceBuffer *buffer = trace_this_thread();
+    if (buffer->count == buffer->capacity) {
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 1024;
+        buffer->events = realloc(buffer->events, buffer->capacity * sizeof(TraceEvent));
+    }
+    TraceEvent *event = &buffer->events[buffer->count++];
+    event->name = name;
+    event->start = start;
+    event->duration = end - start;
+    event->args[0] = '\0';
+    if (fmt) {
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(event->args, sizeof(event->args), fmt, ap);
+        va_end(ap);
+    }
+}
+
+static void start_tracing(void) {
+    tracing = true;
+    clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+}
+
+// Must only be called once every traced thread has finished
+static void write_trace(const char *path) {
+    if (!tracing) return;
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Error: could not open trace file %s\n", path);
+        exit(1);
+    }
+    fprintf(f, "{\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"fractabubbler\"}}");
+    for (TraceBuffer *buffer = atomic_load(&trace_buffers); buffer; buffer = buffer->next) {
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                buffer->tid, buffer->thread_name);
+        for (int i = 0; i < buffer->count; i++) {
+            const TraceEvent *e = &buffer->events[i];
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{%s}}",
+                    e->name, buffer->tid, e->start, e->duration, e->args);
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+}
+
+static inline bool is_inside(const Bitmap img, int x, int y, SearchStats *stats) {
+    stats->reads++;
+    if (stats->heat) stats->heat->reads[y * stats->heat->width + x]++;
+    return img.data[y * img.stride + x] != 0;
+}
+
+// Optimized midpoint circle algorithm
+// https://en.wikipedia.org/wiki/Midpoint_circle_algorithm#Jesko's_Method
+static bool is_circle_in_image(Bitmap img, int cx, int cy, int r, SearchStats *stats) {
+    int x = r;  
+    int y = 0;
+    int t1 = r / 16;
+    int t2 = 0;
+    stats->probes++;
+    if (stats->heat) stats->heat->probes[cy * stats->heat->width + cx]++;
+    while (y <= x) {
+        if (!is_inside(img, cx + x, cy + y, stats)) return false;
+        if (!is_inside(img, cx + x, cy - y, stats)) return false;
+        if (!is_inside(img, cx - x, cy + y, stats)) return false;
+        if (!is_inside(img, cx - x, cy - y, stats)) return false;
+        if (!is_inside(img, cx + y, cy + x, stats)) return false;
+        if (!is_inside(img, cx - y, cy + x, stats)) return false;
+        if (!is_inside(img, cx + y, cy - x, stats)) return false;
+        if (!is_inside(img, cx - y, cy - x, stats)) return false;
+        y++;
+        t1 = t1 + y;
+        t2 = t1 - x;
+        if (t2 >= 0) {
+            t1 = t2;
+            x--;
+        }
+    }
+    return true;
+}
+
+static double get_circle(const Bitmap img, int px, int py, int r, int max_radius, SearchStats *stats) {
+    if (r > max_radius) return r-1;
+
+    if (px - r < 0 || px + r >= img.width
+        || py - r < 0 || py + r >= img.height) return r-1;
+
+    if (!is_circle_in_image(img, px, py, r, stats)) return r-1;
+
+    return get_circle(img, px, py, r+1, max_radius, stats);
+}
+
+static int find_biggest_circle(const Bitmap img, int max_radius, int *const out_x, int *const out_y, SearchStats *stats) {
+    double greatest_radius = 0;
+    for (int x = 0; x < img.width; x++) {
+        for (int y = 0; y < img.height; y++) {
+            double r = get_circle(img, x, y, 0, max_radius, stats);
+            if (r > greatest_radius) {
+                greatest_radius = r;
+                *out_x = x;
+                *out_y = y;
+                // Nothing later in the scan can beat the ceiling
+                if (greatest_radius >= max_radius) return greatest_radius;
+            }
+        }
+    }
+    return greatest_radius;
+}
+
+/*
+* Squared Euclidean distance transform (Felzenszwalb & Huttenlocher) of a
+* window of the bitmap: for every pixel in the window, the squared distance
+* to the nearest empty pixel. Everything beyond the window counts as empty,
+* so distances are never overestimated.
+*/
+static void distance_transform_line(const float *f, int n, float *d, int *v, float *z) {
+    int k = 0;
+    v[0] = 0;
+    z[0] = -1e20f;
+    z[1] = 1e20f;
+    for (int q = 1; q < n; q++) {
+        float s;
+        for (;;) {
+            s = ((f[q] + q*q) - (f[v[k]] + v[k]*v[k])) / (2*q - 2*v[k]);
+            if (s > z[k]) break;
+            k--;
+        }
+        k++;
+        v[k] = q;
+        z[k] = s;
+        z[k + 1] = 1e20f;
+    }
+    k = 0;
+    for (int q = 0; q < n; q++) {
+        while (z[k + 1] < q) k++;
+        d[q] = (q - v[k]) * (q - v[k]) + f[v[k]];
+    }
+}
+
+static float *squared_distance_field(Bitmap img, int x0, int y0, int w, int h) {
+    // One pixel of empty frame around the window
+    const int pw = w + 2, ph = h + 2, n = pw > ph ? pw : ph;
+    float *grid = malloc((size_t)pw * ph * sizeof(float));
+    float *f = calloc(n, sizeof(float)), *d = malloc(n * sizeof(float)), *z = malloc((n + 1) * sizeof(float));
+    int *v = malloc(n * sizeof(int));
+    for (int y = 0; y < ph; y++) {
+        for (int x = 0; x < pw; x++) {
+            const bool frame = x == 0 || y == 0 || x == pw - 1 || y == ph - 1;
+            grid[y * pw + x] = frame || img.data[(y0 + y - 1) * img.stride + (x0 + x - 1)] == 0 ? 0 : 1e20f;
+        }
+    }
+    for (int x = 0; x < pw; x++) {
+        for (int y = 0; y < ph; y++) f[y] = grid[y * pw + x];
+        distance_transform_line(f, ph, d, v, z);
+        for (int y = 0; y < ph; y++) grid[y * pw + x] = d[y];
+    }
+    float *field = malloc((size_t)w * h * sizeof(float));
+    for (int y = 0; y < ph; y++) {
+        memcpy(f, &grid[y * pw], pw * sizeof(float));
+        distance_transform_line(f, pw, d, v, z);
+        if (y > 0 && y < ph - 1) memcpy(&field[(y - 1) * w], &d[1], w * sizeof(float));
+    }
+    free(grid);
+    free(f);
+    free(d);
+    free(z);
+    free(v);
+    return field;
+}
+
+/* Every face of a font file, mapped once */
+typedef struct {
+    const char *path;
+    const uint8_t *data;
+    stbtt_fontinfo *faces;
+    int face_count;
+} FontFile;
+
+// The face the calling thread is working on
+static _Thread_local const stbtt_fontinfo *font;
+
+/* Delaunay triangle with counterclockwise vertices and its circumcircle */
+typedef struct {
+    int v[3];
+    int n[3];        // neighbour opposite v[i], -1 outside the triangulation
+    double cx, cy, r2;
+    int visited;     // last insertion that looked at it
+    bool alive;
+} Triangle;
+
+typedef struct {
+    double x, y;
+} Point;
+
+/* Outline segments bucketed by rows, to find the ones near a point */
+typedef struct {
+    Point *from;
+    Point *to;
+    int count;
+    int bucket_size;
+    int buckets;
+    int *start;      // segments of bucket b are index[start[b]..start[b+1])
+    int *index;
+} Outline;
+
+/* Boundary edge of the hole a new Delaunay site leaves */
+typedef struct {
+    int a, b;        // counterclockwise as seen from the hole
+    int outside;     // triangle across the edge
+    int created;     // triangle joining it to the site
+} CavityEdge;
+
+/* A gap left by three circles touching pairwise, or by two and the outline */
+typedef struct {
+    int a, b, c;     // indices into the placed circles, c = -1 for a gap
+                     // between two circles and the outline (ENGINE_VORONOI:
+                     // a is the Delaunay triangle whose circumcircle this is)
+    Circle inscribed;
+} Gap;
+
+/* Max-heap of gaps by the radius of their inscribed circle */
+typedef struct {
+    Gap *items;
+    int count;
+    int capacity;
+} Gaps;
+
+/* Uniform grid of cells listing the circles overlapping them */
+typedef struct {
+    int cell_size;
+    int width;
+    int height;
+    int **members;   // circle indices per cell
+    int *counts;
+    int *capacities;
+} CircleGrid;
+
+/* State a search engine keeps across passes over the same bitmap */
+typedef struct {
+    Engine engine;
+    Bitmap img;
+    int max_radius;
+    double tolerance;
+    SearchStats stats;
+
+    // ENGINE_PREFIX: empty[y * (width + 1) + x] is the number of zero pixels
+    // in row y to the left of column x
+    int32_t *empty;
+    // Same layout, summing 255 - coverage, and counting the pixels circles
+    // cleared; only kept with a tolerance
+    int32_t *uncovered;
+    int32_t *stamped;
+
+    // Pixels circles cleared, one byte each; kept with a tolerance or
+    // oversampling
+    uint8_t *stamps;
+
+    // Candidate centers are limited to [0, scan_width) x [scan_top, scan_height)
+    int scan_width;
+    int scan_top;
+    int scan_height;
+    // Threads scanning bands of columns in parallel, started with the search
+    int threads;
+    struct ColumnPool *pool;
+
+    // Adaptive fineness: distance from each pixel to the original outline
+    float *outline_distance;
+    int edge_fineness;
+    int interior_fineness;
+    int fineness_ramp;
+
+    // ENGINE_APOLLONIAN: every placed circle, a grid to find touching ones
+    // and the gaps between them still to fill
+    int fineness;
+    int gap_radius;
+    bool filling_gaps;
+    Circles placed;
+    CircleGrid grid;
+    Gaps gaps;
+
+    // ENGINE_VORONOI: Delaunay triangulation of the samples of the outline
+    // and of the placed circles' perimeters, with the gaps above as the
+    // heap of its circumcircles
+    Point *sites;
+    int site_count;
+    int site_capacity;
+    uint64_t jitter;
+    Triangle *triangles;
+    int triangle_count;
+    int triangle_capacity;
+    int last_triangle;
+    int *cavity;
+    CavityEdge *cavity_edges;
+    int cavity_capacity;
+
+    // ENGINE_APOLLONIAN and ENGINE_VORONOI: the glyph's flattened outline
+    Outline outline;
+} Search;
+
+/*
+* With adaptive fineness the smallest allowed radius depends on how far the
+* circle stays from the glyph's outline: circles touching it may be as small
+* as the edge fineness, circles deep inside must reach the interior fineness.
+* Interior cracks between big circles are invisible, the edges are not.
+*/
+static bool is_fine_enough(const Search *search, int x, int y, int r) {
+    if (search->outline_distance == NULL) return true;
+    const double gap = search->outline_distance[y * search->img.width + x] - r;
+    const double t = gap <= 0 ? 0 : gap >= search->fineness_ramp ? 1 : gap / search->fineness_ramp;
+    return r >= search->edge_fineness + (search->interior_fineness - search->edge_fineness) * t;
+}
+
+/*
+* ENGINE_PREFIX answers "does the disc of radius r around (cx, cy) contain a
+* zero pixel" with two prefix count lookups per row, O(r) in total instead of
+* the O(r^2) of probing every perimeter up to r. The predicate is monotone in
+* r, so the largest radius is found by galloping and binary searching.
+*
+* With a tolerance the rasterizer's antialiasing is taken into account: a disc
+* also fits if its summed uncovered coverage stays below the tolerance times
+* its area. That lets circles swallow partially covered rim pixels instead of
+* leaving them to a swarm of tiny circles. Pixels cleared by other circles
+* look the same as those outside the glyph, so they are counted apart and
+* never tolerated: tolerant circles do not overlap. The relaxed predicate is
+* only roughly monotone, which the radius search accepts.
+*/
+static void update_prefix_rows(Search *search, int y0, int y1) {
+    const Bitmap img = search->img;
+    for (int y = y0; y < y1; y++) {
+        const uint8_t *row = &img.data[y * img.stride];
+        int32_t *empty = &search->empty[y * (img.width + 1)];
+        empty[0] = 0;
+        for (int x = 0; x < img.width; x++) {
+            empty[x + 1] = empty[x] + (row[x] == 0);
+        }
+        if (search->uncovered) {
+            const uint8_t *stamps = &search->stamps[y * img.width];
+            int32_t *uncovered = &search->uncovered[y * (img.width + 1)];
+            int32_t *stamped = &search->stamped[y * (img.width + 1)];
+            uncovered[0] = stamped[0] = 0;
+            for (int x = 0; x < img.width; x++) {
+                uncovered[x + 1] = uncovered[x] + (255 - row[x]);
+                stamped[x + 1] = stamped[x] + stamps[x];
+            }
+        }
+    }
+}
+
+static bool is_disc_in_image(Search *search, int cx, int cy, int r) {
+    const int stride = search->img.width + 1;
+    SearchStats *stats = &search->stats;
+    stats->probes++;
+    if (stats->heat) stats->heat->probes[cy * stats->heat->width + cx]++;
+    long empty_pixels = 0, uncovered = 0, area = 0;
+    // Like the perimeter test, the rim half a pixel past r must be inside
+    // too: stamps only clear pixels closer than r, so a neighbour's rim
+    // pixels at exactly r are left and would otherwise be overlapped
+    const double rim = (r + 0.5) * (r + 0.5);
+    for (int dy = -r; dy <= r; dy++) {
+        const int half = (int)sqrt(rim - dy*dy);
+        const int row = (cy + dy) * stride;
+        stats->reads += 2;
+        if (stats->heat) {
+            stats->heat->reads[(cy + dy) * stats->heat->width + cx - half]++;
+            stats->heat->reads[(cy + dy) * stats->heat->width + cx + half]++;
+        }
+        const int32_t empty = search->empty[row + cx + half + 1] - search->empty[row + cx - half];
+        if (search->uncovered == NULL) {
+            if (empty) return false;
+            continue;
+        }
+        stats->reads += 4;
+        if (search->stamped[row + cx + half + 1] - search->stamped[row + cx - half]) return false;
+        empty_pixels += empty;
+        uncovered += search->uncovered[row + cx + half + 1] - search->uncovered[row + cx - half];
+        area += 2*half + 1;
+    }
+    return empty_pixels == 0 || uncovered <= search->tolerance * 255 * area;
+}
+
+// Largest radius that fits at (px, py) if it is at least `at_least`,
+// otherwise at_least - 1
+static int get_disc(Search *search, int px, int py, int at_least) {
+    const Bitmap img = search->img;
+    const int limit = min(min(search->max_radius, min(px, img.width - 1 - px)), min(py, img.height - 1 - py));
+    if (at_least > limit || !is_disc_in_image(search, px, py, at_least)) return at_least - 1;
+
+    int fits = at_least, fails = limit + 1;
+    for (int step = 1; fits + step <= limit; step *= 2) {
+        if (!is_disc_in_image(search, px, py, fits + step)) {
+            fails = fits + step;
+            break;
+        }
+        fits += step;
+    }
+    while (fails - fits > 1) {
+        const int mid = fits + (fails - fits) / 2;
+        if (is_disc_in_image(search, px, py, mid)) fits = mid;
+        else fails = mid;
+    }
+    return fits;
+}
+
+static int scan_biggest_disc(Search *search, int x0, int x1, int *const out_x, int *const out_y) {
+    int greatest_radius = 0;
+    for (int x = x0; x < x1; x++) {
+        for (int y = search->scan_top; y < search->scan_height; y++) {
+            // Only circles strictly bigger than the current best matter,
+            // so most pixels are rejected by a single disc test
+            int r = get_disc(search, x, y, greatest_radius + 1);
+            if (r > greatest_radius && is_fine_enough(search, x, y, r)) {
+                greatest_radius = r;
+                *out_x = x;
+                *out_y = y;
+                if (greatest_radius >= search->max_radius) return greatest_radius;
+            }
+        }
+    }
+    return greatest_radius;
+}
+
+/*
+* Glyphs too big to run next to others get several threads for their own
+* search instead: every thread scans a band of columns with its own copy of
+* the search (for the statistics) and the first biggest disc in column order
+* wins, exactly as if one thread had scanned them all. The threads live as
+* long as the search and wait for each pass on a condition variable, as a
+* glyph takes a pass per circle.
+*/
+typedef struct {
+    Search search;
+    int x0, x1;
+    int r, x, y;
+} ColumnScan;
+
+typedef struct ColumnPool {
+    pthread_t *ids;
+    ColumnScan *scans;
+    int threads;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    int pass;       // bumped to start the scans of a pass
+    int pending;    // scans of the pass still running
+    bool stopping;
+} ColumnPool;
+
+typedef struct {
+    ColumnPool *pool;
+    int index;
+} ColumnThread;
+
+static void *scan_columns(void *arg) {
+    ColumnThread thread = *(ColumnThread *)arg;
+    free(arg);
+    ColumnPool *pool = thread.pool;
+    ColumnScan *scan = &pool->scans[thread.index];
+    int pass = 0;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->pass == pass && !pool->stopping) pthread_cond_wait(&pool->start, &pool->lock);
+        pass = pool->pass;
+        const bool stopping = pool->stopping;
+        pthread_mutex_unlock(&pool->lock);
+        if (stopping) return NULL;
+
+        scan->r = scan_biggest_disc(&scan->search, scan->x0, scan->x1, &scan->x, &scan->y);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) pthread_cond_signal(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static ColumnPool *start_column_pool(int threads) {
+    ColumnPool *pool = calloc(1, sizeof(ColumnPool));
+    pool->threads = threads;
+    pool->ids = malloc(threads * sizeof(pthread_t));
+    pool->scans = calloc(threads, sizeof(ColumnScan));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (int i = 0; i < threads; i++) {
+        ColumnThread *thread = malloc(sizeof(ColumnThread));
+        *thread = (ColumnThread) { pool, i };
+        pthread_create(&pool->ids[i], NULL, scan_columns, thread);
+    }
+    return pool;
+}
+
+static void stop_column_pool(ColumnPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->threads; i++) pthread_join(pool->ids[i], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool->ids);
+    free(pool->scans);
+    free(pool);
+}
+
+static int find_biggest_disc(Search *search, int *const out_x, int *const out_y) {
+    ColumnPool *pool = search->pool;
+    if (!pool) return scan_biggest_disc(search, 0, search->scan_width, out_x, out_y);
+
+    // The scan bounds may have changed since the last pass
+    ColumnScan *const scans = pool->scans;
+    const int threads = pool->threads;
+    for (int i = 0; i < threads; i++) {
+        scans[i] = (ColumnScan) {
+            .search = *search,
+            .x0 = search->scan_width * i / threads,
+            .x1 = search->scan_width * (i + 1) / threads,
+        };
+        scans[i].search.pool = NULL;
+        scans[i].search.stats.probes = scans[i].search.stats.reads = 0;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->pending = threads;
+    pool->pass++;
+    pthread_cond_broadcast(&pool->start);
+    while (pool->pending > 0) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    int greatest_radius = 0;
+    for (int i = 0; i < threads; i++) {
+        search->stats.probes += scans[i].search.stats.probes;
+        search->stats.reads += scans[i].search.stats.reads;
+        if (scans[i].r > greatest_radius) {
+            greatest_radius = scans[i].r;
+            *out_x = scans[i].x;
+            *out_y = scans[i].y;
+        }
+    }
+    return greatest_radius;
+}
+
+/*
+* The glyph's outline flattened to segments, in the coordinates of the
+* bitmap's pixels, for the engines that work with geometry rather than
+* pixels.
+*/
+#define OUTLINE_BUCKET 4   // rows per bucket
+
+static double orientation(Point a, Point b, Point p) {
+    return (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+}
+
+static void add_outline_segment(Outline *outline, Point a, Point b, int *capacity) {
+    if (outline->count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 256;
+        outline->from = realloc(outline->from, *capacity * sizeof(Point));
+        outline->to = realloc(outline->to, *capacity * sizeof(Point));
+    }
+    outline->from[outline->count] = a;
+    outline->to[outline->count] = b;
+    outline->count++;
+}
+
+static void bucket_outline(Outline *outline, int height) {
+    outline->bucket_size = OUTLINE_BUCKET;
+    outline->buckets = height / OUTLINE_BUCKET + 1;
+    outline->start = calloc(outline->buckets + 1, sizeof(int));
+    for (int pass = 0; pass < 2; pass++) {
+        int *fill = pass ? calloc(outline->buckets, sizeof(int)) : NULL;
+        for (int i = 0; i < outline->count; i++) {
+            const double y0 = fmin(outline->from[i].y, outline->to[i].y), y1 = fmax(outline->from[i].y, outline->to[i].y);
+            const int b0 = (int)fmax(0, floor(y0 / OUTLINE_BUCKET)), b1 = min(outline->buckets - 1, (int)floor(y1 / OUTLINE_BUCKET));
+            for (int b = b0; b <= b1; b++) {
+                if (pass) outline->index[outline->start[b] + fill[b]++] = i;
+                else outline->start[b + 1]++;
+            }
+        }
+        if (!pass) {
+            for (int b = 0; b < outline->buckets; b++) outline->start[b + 1] += outline->start[b];
+            outline->index = malloc((outline->start[outline->buckets] + 1) * sizeof(int));
+        }
+        free(fill);
+    }
+}
+
+// Pixel x covers [x, x + 1) in the rasterizer but sits at x in a circle
+static Point font_to_pixels(stbtt__point p, float scale, int baseline) {
+    return (Point) { p.x * scale - 0.5, baseline - p.y * scale - 0.5 };
+}
+
+// Flattens the glyph's contours into search->outline
+static void load_outline(Search *search, int glyph) {
+    const Bitmap img = search->img;
+    const float scale = stbtt_ScaleForPixelHeight(font, img.height);
+    int ascent;
+    stbtt_GetFontVMetrics(font, &ascent, NULL, NULL);
+    const int baseline = (int)(ascent * scale);
+
+    stbtt_vertex *vertices;
+    const int vertex_count = stbtt_GetCodepointShape(font, glyph, &vertices);
+    int *lengths = NULL, contours = 0, capacity = 0;
+    stbtt__point *points = stbtt_FlattenCurves(vertices, vertex_count, 0.1f / scale, &lengths, &contours, NULL);
+    int offset = 0;
+    for (int c = 0; c < contours; offset += lengths[c++]) {
+        for (int i = 0; i < lengths[c]; i++) {
+            const Point a = font_to_pixels(points[offset + i], scale, baseline);
+            const Point b = font_to_pixels(points[offset + (i + 1) % lengths[c]], scale, baseline);
+            add_outline_segment(&search->outline, a, b, &capacity);
+        }
+    }
+    bucket_outline(&search->outline, img.height);
+    free(lengths);
+    free(points);
+    stbtt_FreeShape(font, vertices);
+}
+
+/*
+* ENGINE_APOLLONIAN. Once the raster search only finds circles smaller than
+* the gap radius, most of what is left are the curved triangular gaps between
+* three circles touching each other, as in an Apollonian gasket. The circle
+* inscribed in such a gap has a closed form (the problem of Apollonius for
+* three externally tangent circles), so it is computed instead of searched
+* for and only verified against the bitmap with O(r) prefix count lookups.
+* Along the glyph's outline the gaps are between two touching circles and
+* the outline instead; with the outline flattened to segments, the circle
+* tangent to both and to a segment's line solves the same way. Every placed
+* circle opens new gaps with its touching neighbours and their pairs. Only
+* when no gap is left does the raster search run again.
+*/
+#define GAP_TOUCHING 2.0   // circles closer than this many pixels touch
+#define OUTLINE_SLACK 0.01 // pixels a contact may lie past the end of a segment
+#define GRID_CELL 8
+
+static void grid_add(CircleGrid *grid, Circle c, int index) {
+    const int x0 = (int)fmax(0, (c.x - c.r) / grid->cell_size), x1 = min(grid->width - 1, (int)((c.x + c.r) / grid->cell_size));
+    const int y0 = (int)fmax(0, (c.y - c.r) / grid->cell_size), y1 = min(grid->height - 1, (int)((c.y + c.r) / grid->cell_size));
+    for (int y = y0; y <= y1; y++) {
+        for (int x = x0; x <= x1; x++) {
+            const int cell = y * grid->width + x;
+            if (grid->counts[cell] == grid->capacities[cell]) {
+                grid->capacities[cell] = grid->capacities[cell] ? grid->capacities[cell] * 2 : 4;
+                grid->members[cell] = realloc(grid->members[cell], grid->capacities[cell] * sizeof(int));
+            }
+            grid->members[cell][grid->counts[cell]++] = index;
+        }
+    }
+}
+
+static bool are_adjacent(Circle a, Circle b) {
+    return hypot(a.x - b.x, a.y - b.y) - a.r - b.r <= GAP_TOUCHING;
+}
+
+// Indices of the placed circles touching placed circle `index`, at most max
+static int touching_circles(const Search *search, int index, int *out, int max) {
+    const CircleGrid *grid = &search->grid;
+    const Circle c = search->placed.items[index];
+    const double reach = c.r + GAP_TOUCHING;
+    const int x0 = (int)fmax(0, (c.x - reach) / grid->cell_size), x1 = min(grid->width - 1, (int)((c.x + reach) / grid->cell_size));
+    const int y0 = (int)fmax(0, (c.y - reach) / grid->cell_size), y1 = min(grid->height - 1, (int)((c.y + reach) / grid->cell_size));
+    int count = 0;
+    for (int y = y0; y <= y1; y++) {
+        for (int x = x0; x <= x1; x++) {
+            const int cell = y * grid->width + x;
+            for (int i = 0; i < grid->counts[cell]; i++) {
+                const int other = grid->members[cell][i];
+                if (other == index || !are_adjacent(c, search->placed.items[other])) continue;
+                bool seen = false;
+                for (int k = 0; k < count && !seen; k++) seen = out[k] == other;
+                if (!seen && count < max) out[count++] = other;
+            }
+        }
+    }
+    return count;
+}
+
+// The circles of radius r > 0 externally tangent to p whose center also
+// satisfies eq[i][0] x + eq[i][1] y + eq[i][2] r = eq[i][3] for i = 0, 1
+static int tangent_circles(Circle p, const double eq[2][4], Circle out[2]) {
+    const double a2 = eq[0][0], b2 = eq[0][1], c2 = eq[0][2], d2 = eq[0][3];
+    const double a3 = eq[1][0], b3 = eq[1][1], c3 = eq[1][2], d3 = eq[1][3];
+    const double det = a2 * b3 - a3 * b2;
+    if (fabs(det) < 1e-9) return 0;
+    // x = x0 + xr * r, y = y0 + yr * r
+    const double x0 = (d2 * b3 - d3 * b2) / det, xr = (c3 * b2 - c2 * b3) / det;
+    const double y0 = (a2 * d3 - a3 * d2) / det, yr = (a3 * c2 - a2 * c3) / det;
+    // Substituting into |center - p| = r + p.r gives a quadratic in r
+    const double px = x0 - p.x, py = y0 - p.y;
+    const double A = xr*xr + yr*yr - 1, B = 2 * (px*xr + py*yr - p.r), C = px*px + py*py - p.r*p.r;
+    double roots[2];
+    int count = 0, found = 0;
+    if (fabs(A) < 1e-12) {
+        if (fabs(B) > 1e-12) roots[count++] = -C / B;
+    } else {
+        const double disc = B*B - 4*A*C;
+        if (disc < 0) return 0;
+        roots[count++] = (-B - sqrt(disc)) / (2*A);
+        roots[count++] = (-B + sqrt(disc)) / (2*A);
+    }
+    for (int i = 0; i < count; i++) {
+        if (roots[i] > 0) out[found++] = (Circle) { x0 + xr * roots[i], y0 + yr * roots[i], roots[i] };
+    }
+    return found;
+}
+
+// |center - p| = r + p.r minus |center - q| = r + q.r, which is linear
+static void tangent_difference(Circle p, Circle q, double eq[4]) {
+    eq[0] = 2 * (p.x - q.x);
+    eq[1] = 2 * (p.y - q.y);
+    eq[2] = 2 * (p.r - q.r);
+    eq[3] = (p.x*p.x - q.x*q.x) + (p.y*p.y - q.y*q.y) - (p.r*p.r - q.r*q.r);
+}
+
+// The circle externally tangent to all three, inside the triangle of their
+// centers. Returns false if there is none.
+static bool inscribed_circle(Circle p, Circle q, Circle s, Circle *out) {
+    double eq[2][4];
+    tangent_difference(p, q, eq[0]);
+    tangent_difference(p, s, eq[1]);
+    Circle candidates[2];
+    const int count = tangent_circles(p, eq, candidates);
+    bool found = false;
+    for (int i = 0; i < count; i++) {
+        const double x = candidates[i].x, y = candidates[i].y;
+        if (found && candidates[i].r >= out->r) continue;
+        // Inside the triangle of centers: same side of every edge
+        const double e1 = (q.x - p.x) * (y - p.y) - (q.y - p.y) * (x - p.x);
+        const double e2 = (s.x - q.x) * (y - q.y) - (s.y - q.y) * (x - q.x);
+        const double e3 = (p.x - s.x) * (y - s.y) - (p.y - s.y) * (x - s.x);
+        if (!((e1 >= 0 && e2 >= 0 && e3 >= 0) || (e1 <= 0 && e2 <= 0 && e3 <= 0))) continue;
+        *out = candidates[i];
+        found = true;
+    }
+    return found;
+}
+
+// The circle externally tangent to p and q and touching the outline segment
+// from a to b, on the segment's side of the line through their centers.
+// Returns false if there is none.
+static bool outline_gap_circle(Circle p, Circle q, Point a, Point b, Circle *out) {
+    const double length = hypot(b.x - a.x, b.y - a.y);
+    if (length < 1e-9) return false;
+    // Unit normal of the segment's line pointing to both centers
+    double nx = (a.y - b.y) / length, ny = (b.x - a.x) / length, d = nx * a.x + ny * a.y;
+    if (nx * p.x + ny * p.y < d) {
+        nx = -nx;
+        ny = -ny;
+        d = -d;
+    }
+    if (nx * q.x + ny * q.y <= d) return false;
+    double eq[2][4] = { {0}, { nx, ny, -1, d } };  // the distance to the line is r
+    tangent_difference(p, q, eq[0]);
+    Circle candidates[2];
+    const int count = tangent_circles(p, eq, candidates);
+    const Point from = { p.x, p.y }, to = { q.x, q.y };
+    bool found = false;
+    for (int i = 0; i < count; i++) {
+        const Circle c = candidates[i];
+        if (found && c.r >= out->r) continue;
+        // The point of contact on the segment itself, not the line beyond it
+        const Point touch = { c.x - nx * c.r, c.y - ny * c.r };
+        const double along = ((touch.x - a.x) * (b.x - a.x) + (touch.y - a.y) * (b.y - a.y)) / length;
+        if (along < -OUTLINE_SLACK || along > length + OUTLINE_SLACK) continue;
+        // In the pocket between p, q and the outline, not on the far side of p and q
+        const Point inward = { p.x - nx, p.y - ny };
+        if (orientation(from, to, (Point) { c.x, c.y }) * orientation(from, to, inward) <= 0) continue;
+        *out = c;
+        found = true;
+    }
+    return found;
+}
+
+static void push_gap(Gaps *gaps, Gap gap) {
+    if (gaps->count == gaps->capacity) {
+        gaps->capacity = gaps->capacity ? gaps->capacity * 2 : 64;
+        gaps->items = realloc(gaps->items, gaps->capacity * sizeof(Gap));
+    }
+    int i = gaps->count++;
+    while (i > 0 && gaps->items[(i - 1) / 2].inscribed.r < gap.inscribed.r) {
+        gaps->items[i] = gaps->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    gaps->items[i] = gap;
+}
+
+static Gap pop_gap(Gaps *gaps) {
+    const Gap top = gaps->items[0];
+    const Gap last = gaps->items[--gaps->count];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= gaps->count) break;
+        if (child + 1 < gaps->count && gaps->items[child + 1].inscribed.r > gaps->items[child].inscribed.r) child++;
+        if (gaps->items[child].inscribed.r <= last.inscribed.r) break;
+        gaps->items[i] = gaps->items[child];
+        i = child;
+    }
+    if (gaps->count > 0) gaps->items[i] = last;
+    return top;
+}
+
+// Queue the gaps between placed circles `index` and `other` and the outline
+// segments near where they touch, the smallest on either side of them
+static void open_outline_gaps(Search *search, int index, int other) {
+    const Circle p = search->placed.items[index], q = search->placed.items[other];
+    const Outline *outline = &search->outline;
+    // Such a gap is no wider than the smaller circle, around where they touch
+    const double t = p.r / (p.r + q.r), reach = fmin(p.r, q.r) + GAP_TOUCHING;
+    const double x = p.x + (q.x - p.x) * t, y = p.y + (q.y - p.y) * t;
+    const int b0 = (int)fmax(0, floor((y - reach) / outline->bucket_size));
+    const int b1 = min(outline->buckets - 1, (int)floor((y + reach) / outline->bucket_size));
+    Gap gaps[2] = {0};
+    for (int b = b0; b <= b1; b++) {
+        for (int k = outline->start[b]; k < outline->start[b + 1]; k++) {
+            const int segment = outline->index[k];
+            const Point from = outline->from[segment], to = outline->to[segment];
+            // Segments spanning several buckets are tried in the first of them
+            const int first = (int)floor(fmin(from.y, to.y) / outline->bucket_size);
+            if (b != max(b0, first)) continue;
+            if (fmax(from.x, to.x) < x - reach || fmin(from.x, to.x) > x + reach) continue;
+            if (fmax(from.y, to.y) < y - reach || fmin(from.y, to.y) > y + reach) continue;
+            Circle c;
+            if (!outline_gap_circle(p, q, from, to, &c)) continue;
+            Gap *side = &gaps[orientation((Point) { p.x, p.y }, (Point) { q.x, q.y }, (Point) { c.x, c.y }) > 0];
+            if (side->inscribed.r == 0 || c.r < side->inscribed.r) *side = (Gap) { index, other, -1, c };
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (gaps[i].inscribed.r >= search->fineness) push_gap(&search->gaps, gaps[i]);
+    }
+}
+
+// Queue the gaps between placed circle `index`, earlier placed circles and
+// the outline
+static void open_gaps(Search *search, int index) {
+    int touching[64];
+    const int count = touching_circles(search, index, touching, 64);
+    for (int i = 0; i < count; i++) {
+        if (touching[i] < index) open_outline_gaps(search, index, touching[i]);
+    }
+    for (int i = 0; i < count; i++) {
+        for (int j = i + 1; j < count; j++) {
+            if (touching[i] > index || touching[j] > index) continue;
+            const Circle a = search->placed.items[touching[i]], b = search->placed.items[touching[j]];
+            if (!are_adjacent(a, b)) continue;
+            Gap gap = { .a = index, .b = touching[i], .c = touching[j] };
+            if (!inscribed_circle(search->placed.items[index], a, b, &gap.inscribed)) continue;
+            if (gap.inscribed.r < search->fineness) continue;
+            push_gap(&search->gaps, gap);
+        }
+    }
+}
+
+// Whether every pixel center within c.r of the (fractional) center is inside
+static bool is_float_disc_in_image(Search *search, Circle c) {
+    const Bitmap img = search->img;
+    // Written so that a NaN from a degenerate gap fails too
+    if (!(c.x - c.r >= 0 && c.y - c.r >= 0 && c.x + c.r < img.width - 1 && c.y + c.r < img.height - 1)) return false;
+    const int stride = img.width + 1;
+    search->stats.probes++;
+    if (search->stats.heat) search->stats.heat->probes[(int)c.y * img.width + (int)c.x]++;
+    for (int y = (int)ceil(c.y - c.r); y <= (int)floor(c.y + c.r); y++) {
+        const double half = sqrt(fmax(0, c.r*c.r - (y - c.y)*(y - c.y)));
+        const int x0 = (int)ceil(c.x - half), x1 = (int)floor(c.x + half);
+        if (x1 < x0) continue;
+        search->stats.reads += 2;
+        if (search->empty[y * stride + x1 + 1] != search->empty[y * stride + x0]) return false;
+    }
+    return true;
+}
+
+// Shrink the predicted circle until the bitmap agrees it fits
+static bool fit_gap(Search *search, Circle predicted, Circle *out) {
+    Circle c = predicted;
+    c.r = fmin(floor(c.r * 100) / 100, search->max_radius);
+    c.x = round(c.x * 100) / 100;
+    c.y = round(c.y * 100) / 100;
+    if (!is_float_disc_in_image(search, c)) {
+        double fits = search->fineness, fails = c.r;
+        c.r = fits;
+        if (!is_float_disc_in_image(search, c)) return false;
+        for (int i = 0; i < 8; i++) {
+            c.r = (fits + fails) / 2;
+            if (is_float_disc_in_image(search, c)) fits = c.r;
+            else fails = c.r;
+        }
+        c.r = floor(fits * 100) / 100;
+    }
+    if (!is_fine_enough(search, (int)round(c.x), (int)round(c.y), (int)c.r)) return false;
+    *out = c;
+    return true;
+}
+
+static int find_next_gap_circle(Search *search, Circle *out) {
+    if (!search->filling_gaps) {
+        int x = 0, y = 0;
+        const int r = find_biggest_disc(search, &x, &y);
+        *out = (Circle) { x, y, r };
+        if (r >= search->gap_radius) return r;
+        search->filling_gaps = true;
+        for (int i = 0; i < search->placed.count; i++) open_gaps(search, i);
+    }
+    while (search->gaps.count > 0) {
+        const Gap gap = pop_gap(&search->gaps);
+        if (fit_gap(search, gap.inscribed, out)) return out->r;
+    }
+    int x = 0, y = 0;
+    const int r = find_biggest_disc(search, &x, &y);
+    *out = (Circle) { x, y, r };
+    return r;
+}
+
+/*
+* ENGINE_VORONOI. The biggest empty circle is a question about geometry, not
+* pixels: sample the glyph's flattened outline, and the largest circle
+* containing no sample with its center inside the glyph is centered on a
+* vertex of the samples' Voronoi diagram, i.e. the circumcenter of a Delaunay
+* triangle. The triangulation is kept incrementally (Bowyer-Watson) and its
+* circumcircles in a max-heap. Placing a circle inserts samples along its
+* perimeter, which destroys exactly the circumcircles it overlaps.
+*/
+#define VORONOI_SPACING 1.0   // pixels between samples
+
+static int add_site(Search *search, double x, double y) {
+    if (search->site_count == search->site_capacity) {
+        search->site_capacity = search->site_capacity ? search->site_capacity * 2 : 1024;
+        search->sites = realloc(search->sites, search->site_capacity * sizeof(Point));
+    }
+    // Samples along straight edges and circles are collinear and cocircular;
+    // a deterministic jitter far below a pixel keeps the triangulation
+    // away from those degenerate cases
+    search->jitter = search->jitter * 6364136223846793005ULL + 1442695040888963407ULL;
+    const double dx = ((search->jitter >> 40) / (double)(1 << 24) - 0.5) * 1e-3;
+    const double dy = (((search->jitter >> 16) & 0xffffff) / (double)(1 << 24) - 0.5) * 1e-3;
+    search->sites[search->site_count] = (Point) { x + dx, y + dy };
+    return search->site_count++;
+}
+
+// Whether the triangle's circumcircle is the empty circle of three samples,
+// rather than of the bounding triangle's far away corners
+static bool is_candidate(const Triangle *t) {
+    return t->v[0] >= 3 && t->v[1] >= 3 && t->v[2] >= 3 && isfinite(t->r2);
+}
+
+static int add_triangle(Search *search, int a, int b, int c) {
+    if (search->triangle_count == search->triangle_capacity) {
+        search->triangle_capacity = search->triangle_capacity ? search->triangle_capacity * 2 : 4096;
+        search->triangles = realloc(search->triangles, search->triangle_capacity * sizeof(Triangle));
+    }
+    const Point p = search->sites[a], q = search->sites[b], s = search->sites[c];
+    Triangle t = { .v = { a, b, c }, .n = { -1, -1, -1 }, .visited = -1, .alive = true };
+    const double d = 2 * orientation(p, q, s);
+    const double pp = p.x*p.x + p.y*p.y, qq = q.x*q.x + q.y*q.y, ss = s.x*s.x + s.y*s.y;
+    t.cx = (pp * (q.y - s.y) + qq * (s.y - p.y) + ss * (p.y - q.y)) / d;
+    t.cy = (pp * (s.x - q.x) + qq * (p.x - s.x) + ss * (q.x - p.x)) / d;
+    t.r2 = (t.cx - p.x) * (t.cx - p.x) + (t.cy - p.y) * (t.cy - p.y);
+    const int index = search->triangle_count++;
+    search->triangles[index] = t;
+    if (is_candidate(&t)) {
+        const double r = fmin(sqrt(t.r2) - VORONOI_SPACING / 2, search->max_radius);
+        if (r >= search->fineness) push_gap(&search->gaps, (Gap) { index, 0, 0, { t.cx, t.cy, r } });
+    }
+    return index;
+}
+
+static int locate_triangle(Search *search, Point p) {
+    int t = search->last_triangle;
+    for (int steps = 0; steps < search->triangle_count; steps++) {
+        const Triangle *tri = &search->triangles[t];
+        int next = -1;
+        for (int i = 0; i < 3 && next < 0; i++) {
+            const Point a = search->sites[tri->v[(i + 1) % 3]], b = search->sites[tri->v[(i + 2) % 3]];
+            if (orientation(a, b, p) < 0) next = tri->n[i];
+        }
+        if (next < 0) return t;
+        t = next;
+    }
+    // Walking can cycle on nearly degenerate triangles
+    for (t = 0; t < search->triangle_count; t++) {
+        const Triangle *tri = &search->triangles[t];
+        if (!tri->alive) continue;
+        const Point a = search->sites[tri->v[0]], b = search->sites[tri->v[1]], c = search->sites[tri->v[2]];
+        if (orientation(a, b, p) >= 0 && orientation(b, c, p) >= 0 && orientation(c, a, p) >= 0) return t;
+    }
+    return -1;
+}
+
+// Bowyer-Watson: remove every triangle whose circumcircle contains the new
+// site and connect the site to the boundary of the hole. A site no triangle
+// contains (rounding) is dropped again; it must be the last one added.
+static void insert_site(Search *search, int site) {
+    const Point p = search->sites[site];
+    int cavity_count = 0, edge_count = 0;
+    const int first = locate_triangle(search, p);
+    if (first < 0) {
+        fprintf(stderr, "Warning: skipped Voronoi site (%g, %g) outside the triangulation\n", p.x, p.y);
+        search->site_count--;
+        return;
+    }
+    search->triangles[first].visited = site;
+    search->cavity[cavity_count++] = first;
+    // The cavity doubles as the queue of its own flood fill
+    for (int k = 0; k < cavity_count; k++) {
+        if (cavity_count + 3 > search->cavity_capacity || edge_count + 3 > search->cavity_capacity) {
+            search->cavity_capacity *= 2;
+            search->cavity = realloc(search->cavity, search->cavity_capacity * sizeof(int));
+            search->cavity_edges = realloc(search->cavity_edges, search->cavity_capacity * sizeof(CavityEdge));
+        }
+        const Triangle *tri = &search->triangles[search->cavity[k]];
+        for (int i = 0; i < 3; i++) {
+            const int n = tri->n[i];
+            if (n >= 0) {
+                Triangle *other = &search->triangles[n];
+                if (other->visited == site) continue;
+                search->stats.reads++;
+                const double dx = p.x - other->cx, dy = p.y - other->cy;
+                if (dx*dx + dy*dy < other->r2) {
+                    other->visited = site;
+                    search->cavity[cavity_count++] = n;
+                    continue;
+                }
+            }
+            search->cavity_edges[edge_count++] = (CavityEdge) { tri->v[(i + 1) % 3], tri->v[(i + 2) % 3], n, -1 };
+        }
+    }
+    for (int k = 0; k < cavity_count; k++) search->triangles[search->cavity[k]].alive = false;
+
+    CavityEdge *const edges = search->cavity_edges;
+    for (int k = 0; k < edge_count; k++) {
+        CavityEdge *e = &edges[k];
+        e->created = add_triangle(search, site, e->a, e->b);
+        search->triangles[e->created].n[0] = e->outside;
+        if (e->outside >= 0) {
+            Triangle *other = &search->triangles[e->outside];
+            for (int i = 0; i < 3; i++) {
+                if (other->v[(i + 1) % 3] == e->b && other->v[(i + 2) % 3] == e->a) other->n[i] = e->created;
+            }
+        }
+    }
+    // Consecutive new triangles share the edge from the site to a vertex
+    for (int k = 0; k < edge_count; k++) {
+        Triangle *t = &search->triangles[edges[k].created];
+        for (int j = 0; j < edge_count; j++) {
+            if (edges[j].a == edges[k].b) t->n[1] = edges[j].created;
+            if (edges[j].b == edges[k].a) t->n[2] = edges[j].created;
+        }
+    }
+    search->last_triangle = edges[0].created;
+}
+
+// Nonzero winding rule, like the rasterizer
+static bool is_inside_outline(const Outline *outline, Point p) {
+    const int b = (int)floor(p.y / outline->bucket_size);
+    if (b < 0 || b >= outline->buckets) return false;
+    int winding = 0;
+    for (int k = outline->start[b]; k < outline->start[b + 1]; k++) {
+        const Point a = outline->from[outline->index[k]], c = outline->to[outline->index[k]];
+        if (a.y <= p.y && c.y > p.y && orientation(a, c, p) > 0) winding++;
+        if (c.y <= p.y && a.y > p.y && orientation(a, c, p) < 0) winding--;
+    }
+    return winding != 0;
+}
+
+// Samples the glyph's outline
+static void start_voronoi(Search *search) {
+    const Bitmap img = search->img;
+
+    // Bounding triangle far outside the bitmap
+    const double m = 20.0 * (img.width + img.height);
+    add_site(search, img.width / 2.0 - m, img.height / 2.0 - m);
+    add_site(search, img.width / 2.0 + m, img.height / 2.0 - m);
+    add_site(search, img.width / 2.0, img.height / 2.0 + m);
+    search->last_triangle = add_triangle(search, 0, 1, 2);
+    search->cavity_capacity = 256;
+    search->cavity = malloc(search->cavity_capacity * sizeof(int));
+    search->cavity_edges = malloc(search->cavity_capacity * sizeof(CavityEdge));
+
+    const Outline *outline = &search->outline;
+    double carry = 0;
+    for (int i = 0; i < outline->count; i++) {
+        const Point a = outline->from[i], b = outline->to[i];
+        // Contours are closed, so a new one starts wherever a segment does
+        // not continue the previous one
+        if (i > 0 && (a.x != outline->to[i - 1].x || a.y != outline->to[i - 1].y)) carry = 0;
+        const double length = hypot(b.x - a.x, b.y - a.y);
+        for (; carry < length; carry += VORONOI_SPACING) {
+            insert_site(search, add_site(search, a.x + (b.x - a.x) * carry / length, a.y + (b.y - a.y) * carry / length));
+        }
+        carry -= length;
+    }
+}
+
+static bool is_in_placed_circle(const Search *search, Point p) {
+    const CircleGrid *grid = &search->grid;
+    const int x = (int)floor(p.x / grid->cell_size), y = (int)floor(p.y / grid->cell_size);
+    if (x < 0 || y < 0 || x >= grid->width || y >= grid->height) return false;
+    const int cell = y * grid->width + x;
+    for (int i = 0; i < grid->counts[cell]; i++) {
+        const Circle c = search->placed.items[grid->members[cell][i]];
+        if ((p.x - c.x) * (p.x - c.x) + (p.y - c.y) * (p.y - c.y) < c.r * c.r) return true;
+    }
+    return false;
+}
+
+static int find_largest_empty_circle(Search *search, Circle *out) {
+    while (search->gaps.count > 0) {
+        const Gap gap = pop_gap(&search->gaps);
+        if (!search->triangles[gap.a].alive) continue;
+        search->stats.probes++;
+        const Point center = { gap.inscribed.x, gap.inscribed.y };
+        if (!is_inside_outline(&search->outline, center) || is_in_placed_circle(search, center)) continue;
+        *out = gap.inscribed;
+        return out->r;
+    }
+    *out = (Circle) {0};
+    return 0;
+}
+
+// Makes the perimeter of a placed circle part of the sampled boundary
+static void insert_circle_sites(Search *search, Circle c) {
+    const int count = (int)fmax(8, ceil(2 * M_PI * c.r / VORONOI_SPACING));
+    for (int i = 0; i < count; i++) {
+        const double angle = 2 * M_PI * i / count;
+        insert_site(search, add_site(search, c.x + c.r * cos(angle), c.y + c.r * sin(angle)));
+    }
+}
+
+static Search start_search(const Program program, Bitmap img, HeatMap *heat) {
+    Search search = {
+        .engine = program.engine,
+        .img = img,
+        .max_radius = program.max_radius,
+        .tolerance = program.tolerance,
+        .stats = { .heat = heat },
+        .scan_width = img.width,
+        .scan_height = img.height,
+        .threads = program.search_threads,
+    };
+    if (search.engine == ENGINE_PREFIX || search.engine == ENGINE_APOLLONIAN) {
+        search.empty = malloc((size_t)(img.width + 1) * img.height * sizeof(int32_t));
+        if (search.tolerance > 0) {
+            search.uncovered = malloc((size_t)(img.width + 1) * img.height * sizeof(int32_t));
+            search.stamped = malloc((size_t)(img.width + 1) * img.height * sizeof(int32_t));
+        }
+    }
+    if (search.tolerance > 0 || program.oversample > 1) {
+        search.stamps = calloc((size_t)img.width * img.height, 1);
+    }
+    if (search.empty) {
+        update_prefix_rows(&search, 0, img.height);
+    }
+    if (program.interior_fineness > program.fineness) {
+        search.outline_distance = squared_distance_field(img, 0, 0, img.width, img.height);
+        for (long i = 0; i < (long)img.width * img.height; i++) {
+            search.outline_distance[i] = sqrtf(search.outline_distance[i]);
+        }
+        search.edge_fineness = program.fineness;
+        search.interior_fineness = program.interior_fineness;
+        search.fineness_ramp = program.fineness_ramp;
+    }
+    if (search.engine == ENGINE_APOLLONIAN || search.engine == ENGINE_VORONOI) {
+        search.fineness = program.fineness;
+        search.gap_radius = program.gap_radius ? program.gap_radius : 3 * program.fineness;
+        CircleGrid *grid = &search.grid;
+        grid->cell_size = GRID_CELL;
+        grid->width = (img.width + GRID_CELL - 1) / GRID_CELL;
+        grid->height = (img.height + GRID_CELL - 1) / GRID_CELL;
+        grid->members = calloc(grid->width * grid->height, sizeof(int *));
+        grid->counts = calloc(grid->width * grid->height, sizeof(int));
+        grid->capacities = calloc(grid->width * grid->height, sizeof(int));
+    }
+    if (search.engine == ENGINE_APOLLONIAN || search.engine == ENGINE_VORONOI) {
+        load_outline(&search, program.glyph);
+    }
+    if (search.engine == ENGINE_VORONOI) {
+        start_voronoi(&search);
+    }
+    // Heatmap counters are shared between columns and not atomic
+    const int threads = heat ? 1 : min(search.threads, img.width);
+    if (threads > 1 && (search.engine == ENGINE_PREFIX || search.engine == ENGINE_APOLLONIAN)) {
+        search.pool = start_column_pool(threads);
+    }
+    return search;
+}
+
+static int search_biggest_circle(Search *search, Circle *out) {
+    int x = 0, y = 0, r = 0;
+    switch (search->engine) {
+    case ENGINE_PERIMETER:
+        r = find_biggest_circle(search->img, search->max_radius, &x, &y, &search->stats);
+        break;
+    case ENGINE_PREFIX:
+        r = find_biggest_disc(search, &x, &y);
+        break;
+    case ENGINE_APOLLONIAN:
+        return find_next_gap_circle(search, out);
+    case ENGINE_VORONOI:
+        return find_largest_empty_circle(search, out);
+    }
+    *out = (Circle) { x, y, r };
+    return r;
+}
+
+// Pixels whose centers can lie inside the circle, as [x0, x1) x [y0, y1)
+static void circle_bounds(Bitmap img, Circle c, int *x0, int *y0, int *x1, int *y1) {
+    *x0 = c.x - c.r < 0 ? 0 : (int)ceil(c.x - c.r);
+    *y0 = c.y - c.r < 0 ? 0 : (int)ceil(c.y - c.r);
+    *x1 = min(img.width, (int)floor(c.x + c.r) + 1);
+    *y1 = min(img.height, (int)floor(c.y + c.r) + 1);
+}
+
+static void mark_stamps(Search *search, Circle c, uint8_t value) {
+    int x0, y0, x1, y1;
+    circle_bounds(search->img, c, &x0, &y0, &x1, &y1);
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            if ((x - c.x)*(x - c.x) + (y - c.y)*(y - c.y) < c.r*c.r) {
+                search->stamps[y * search->img.width + x] = value;
+            }
+        }
+    }
+}
+
+static void update_circle_rows(Search *search, Circle c) {
+    if (search->engine == ENGINE_PREFIX || search->engine == ENGINE_APOLLONIAN) {
+        int x0, y0, x1, y1;
+        circle_bounds(search->img, c, &x0, &y0, &x1, &y1);
+        update_prefix_rows(search, y0, y1);
+    }
+}
+
+// Must be called after every stamp so the engine sees the cleared pixels
+static void search_stamped(Search *search, Circle c) {
+    if (search->stamps) mark_stamps(search, c, 1);
+    update_circle_rows(search, c);
+}
+
+// Likewise after putting back the pixels under a circle
+static void search_unstamped(Search *search, Circle c) {
+    if (search->stamps) mark_stamps(search, c, 0);
+    update_circle_rows(search, c);
+}
+
+// Must be called for every circle the search result is turned into
+static void search_placed(Search *search, Circle c) {
+    if (search->engine != ENGINE_APOLLONIAN && search->engine != ENGINE_VORONOI) return;
+    push_circle(&search->placed, c);
+    grid_add(&search->grid, c, search->placed.count - 1);
+    if (search->filling_gaps) open_gaps(search, search->placed.count - 1);
+    if (search->engine == ENGINE_VORONOI) insert_circle_sites(search, c);
+}
+
+static void end_search(Search *search) {
+    if (search->pool) stop_column_pool(search->pool);
+    free(search->empty);
+    free(search->uncovered);
+    free(search->stamped);
+    free(search->stamps);
+    free(search->outline_distance);
+    free(search->placed.items);
+    free(search->gaps.items);
+    for (int i = 0; i < search->grid.width * search->grid.height; i++) free(search->grid.members[i]);
+    free(search->grid.members);
+    free(search->grid.counts);
+    free(search->grid.capacities);
+    free(search->sites);
+    free(search->triangles);
+    free(search->cavity);
+    free(search->cavity_edges);
+    free(search->outline.from);
+    free(search->outline.to);
+    free(search->outline.start);
+    free(search->outline.index);
+}
+
+// Maps the file instead of reading it, so that collections of any size cost
+// no more than the pages of the faces and glyphs actually used
+FontFile load_font(const char *file_name) {
+    const double start = trace_now();
+    FontFile file = { .path = file_name };
+    const int fd = open(file_name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error: could not open font %s\n", file_name);
+        exit(1);
+    }
+    file.data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file.data == MAP_FAILED) {
+        fprintf(stderr, "Error: could not map font %s\n", file_name);
+        exit(1);
+    }
+
+    // A plain .ttf counts as a collection of one
+    file.face_count = stbtt_GetNumberOfFonts(file.data);
+    if (file.face_count <= 0) file.face_count = 1;
+    file.faces = calloc(file.face_count, sizeof(stbtt_fontinfo));
+    for (int i = 0; i < file.face_count; i++) {
+        if (!stbtt_InitFont(&file.faces[i], file.data, stbtt_GetFontOffsetForIndex(file.data, i))) {
+            fprintf(stderr, "Error: could not load face %d of %s\n", i, file_name);
+            exit(1);
+        }
+    }
+    trace_span("load font", start, "\"faces\":%d", file.face_count);
+    return file;
+}
+
+static void check_face(const FontFile *file, int face) {
+    if (face >= file->face_count) {
+        fprintf(stderr, "Error: %s has %d face(s), no face %d\n", file->path, file->face_count, face);
+        exit(1);
+    }
+}
+
+/* Where a glyph lands in its bitmap */
+typedef struct {
+    float scale;
+    int width;           // the advance, or further if the glyph reaches past it
+    int baseline;        // row of the baseline
+    int x0, y0, x1, y1;  // the glyph's box, relative to the origin on the baseline
+} GlyphLayout;
+
+static GlyphLayout layout_glyph(int c, int height) {
+    GlyphLayout layout = { .scale = stbtt_ScaleForPixelHeight(font, height) };
+
+    int ascent;
+    stbtt_GetFontVMetrics(font, &ascent, NULL, NULL);
+    layout.baseline = (int) (ascent*layout.scale);
+
+    int advance;
+    stbtt_GetCodepointHMetrics(font, c, &advance, NULL);
+    layout.width = (int)(advance * layout.scale);
+
+    stbtt_GetCodepointBitmapBox(font, c, layout.scale, layout.scale, &layout.x0, &layout.y0, &layout.x1, &layout.y1);
+
+    // Swashes and zero-width marks reach past the advance
+    if (layout.x1 > layout.width) layout.width = layout.x1;
+    return layout;
+}
+
+Bitmap rasterize_glyph(int c, int height) {
+    const double start = trace_now();
+    const GlyphLayout layout = layout_glyph(c, height);
+    const float scale = layout.scale;
+    const int width = layout.width, baseline = layout.baseline;
+    const int x0 = layout.x0, y0 = layout.y0, x1 = layout.x1, y1 = layout.y1;
+    uint8_t* bitmap = calloc(width*height, 1);
+
+    if (x0 >= 0 && baseline + y0 >= 0 && baseline + y1 <= height) {
+        stbtt_MakeCodepointBitmap(font, &bitmap[(baseline + y0) * width + x0], x1-x0,y1-y0, width, scale,scale, c);
+    } else {
+        // Accents above the ascent and the like: render the box and clip it
+        uint8_t *box = calloc((x1-x0) * (y1-y0), 1);
+        stbtt_MakeCodepointBitmap(font, box, x1-x0, y1-y0, x1-x0, scale, scale, c);
+        for (int y = 0; y < y1-y0; y++) {
+            if (baseline + y0 + y < 0 || baseline + y0 + y >= height) continue;
+            for (int x = 0; x < x1-x0; x++) {
+                if (x0 + x >= 0) bitmap[(baseline + y0 + y) * width + x0 + x] = box[y * (x1-x0) + x];
+            }
+        }
+        free(box);
+    }
+
+    trace_span("rasterize", start, "\"glyph\":%d", c);
+    return (Bitmap) {
+        .data = bitmap,
+        .stride = width,
+        .width = width,
+        .height = height,
+    };
+}
+
+#define RASTER_TILE 256  // columns rasterized at once by rasterize_rows()
+
+// Keeps the part of a closed polyline where the coordinate (x if `vertical`,
+// y otherwise) times `sign` is at least `at` times `sign`
+static int clip_polyline(const stbtt__point *in, int n, bool vertical, float at, int sign, stbtt__point *out) {
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        const stbtt__point a = in[(i + n - 1) % n], b = in[i];
+        const float va = vertical ? a.x : a.y, vb = vertical ? b.x : b.y;
+        const bool a_in = sign * (va - at) >= 0, b_in = sign * (vb - at) >= 0;
+        if (a_in != b_in) {
+            const float t = (at - va) / (vb - va);
+            out[count++] = vertical ? (stbtt__point) { at, a.y + (b.y - a.y) * t }
+                                    : (stbtt__point) { a.x + (b.x - a.x) * t, at };
+        }
+        if (b_in) out[count++] = b;
+    }
+    return count;
+}
+
+/*
+* Rows [top, top + rows) of rasterize_glyph()'s bitmap on their own, for
+* glyphs too tall to rasterize whole. stb_truetype only rasterizes from the
+* top of an outline, so the flattened outline is clipped to the rows first:
+* cutting along a line leaves the winding of every point on the kept side as
+* it was. The rows are rasterized in tiles of RASTER_TILE columns the same
+* way, each moved to the origin: the rasterizer's floats are only precise
+* enough for ordinary glyph sizes.
+*/
+static Bitmap rasterize_rows(int c, const GlyphLayout layout, int top, int rows) {
+    const double start = trace_now();
+    Bitmap img = {
+        .data = calloc((size_t)layout.width * rows, 1),
+        .stride = layout.width,
+        .width = layout.width,
+        .height = rows,
+    };
+    // The window in glyph coordinates, clipped to the glyph's box
+    const int y0 = max(top - layout.baseline, layout.y0), y1 = min(top + rows - layout.baseline, layout.y1);
+    if (y0 >= y1 || layout.x0 >= layout.x1) return img;
+
+    stbtt_vertex *vertices;
+    const int vertex_count = stbtt_GetCodepointShape(font, c, &vertices);
+    int *lengths, contours;
+    stbtt__point *points = stbtt_FlattenCurves(vertices, vertex_count, 0.35f / layout.scale, &lengths, &contours, NULL);
+    int total = 0, longest = 0;
+    for (int i = 0; i < contours; i++) {
+        total += lengths[i];
+        longest = max(longest, lengths[i]);
+    }
+    // Relative to the window's corner, then each clip at most doubles a contour
+    for (int i = 0; i < total; i++) {
+        points[i] = (stbtt__point) { points[i].x * layout.scale - layout.x0, -points[i].y * layout.scale - y0 };
+    }
+    stbtt__point *below = malloc(2 * (longest + 1) * sizeof(stbtt__point));
+    stbtt__point *right = malloc(4 * (longest + 1) * sizeof(stbtt__point));
+    stbtt__point *tile = malloc(8 * (total + contours) * sizeof(stbtt__point));
+    int *tile_lengths = malloc((contours + 1) * sizeof(int));
+
+    const int box_width = layout.x1 - layout.x0;
+    uint8_t *box = malloc((size_t)RASTER_TILE * (y1 - y0));
+    for (int left = 0; left < box_width; left += RASTER_TILE) {
+        const int width = min(RASTER_TILE, box_width - left);
+        int count = 0;
+        for (int i = 0, first = 0; i < contours; first += lengths[i++]) {
+            const int n = clip_polyline(&points[first], lengths[i], false, 0, 1, below);
+            const int m = clip_polyline(below, n, true, left, 1, right);
+            tile_lengths[i] = clip_polyline(right, m, true, left + width, -1, &tile[count]);
+            for (int j = count; j < count + tile_lengths[i]; j++) tile[j].x -= left;
+            count += tile_lengths[i];
+        }
+        memset(box, 0, (size_t)width * (y1 - y0));
+        stbtt__bitmap target = { width, y1 - y0, width, box };
+        stbtt__rasterize(&target, tile, tile_lengths, contours, 1, 1, 0, 0, 0, 0, 0, NULL);
+        for (int y = y0; y < y1; y++) {
+            uint8_t *row = &img.data[(y + layout.baseline - top) * img.stride + layout.x0 + left];
+            for (int x = max(-(layout.x0 + left), 0); x < width; x++) row[x] = box[(y - y0) * width + x];
+        }
+    }
+
+    free(box);
+    free(tile_lengths);
+    free(tile);
+    free(right);
+    free(below);
+    free(lengths);
+    free(points);
+    stbtt_FreeShape(font, vertices);
+    trace_span("rasterize rows", start, "\"glyph\":%d,\"top\":%d,\"rows\":%d", c, top, rows);
+    return img;
+}
+
+// Height of the bitmap the search runs on
+static int grid_height(const Program program) {
+    return program.height / program.oversample;
+}
+
+Bitmap make_bitmap(const Program program) {
+    return rasterize_glyph(program.glyph, grid_height(program));
+}
+
+void free_bitmap(Bitmap bitmap) {
+    free(bitmap.data);
+}
+
+static long count_inside(Bitmap img) {
+    long count = 0;
+    for (int y = 0; y < img.height; y++) {
+        for (int x = 0; x < img.width; x++) {
+            count += img.data[y*img.stride + x] != 0;
+        }
+    }
+    return count;
+}
+
+static HeatMap make_heatmap(Bitmap img) {
+    return (HeatMap) {
+        .probes = calloc(img.width * img.height, sizeof(uint32_t)),
+        .reads = calloc(img.width * img.height, sizeof(uint32_t)),
+        .width = img.width,
+        .height = img.height,
+    };
+}
+
+// Written as a binary PGM on a log scale so that the cheap regions stay visible
+static void write_heatmap_layer(const char *path, const HeatMap *heat, const uint32_t *counts) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Error: could not open heatmap %s\n", path);
+        exit(1);
+    }
+    uint32_t max = 0;
+    for (int i = 0; i < heat->width * heat->height; i++) {
+        if (counts[i] > max) max = counts[i];
+    }
+    fprintf(f, "P5\n# max %u\n%d %d\n255\n", max, heat->width, heat->height);
+    const double scale = max ? 255 / log1p(max) : 0;
+    for (int i = 0; i < heat->width * heat->height; i++) {
+        fputc((int)(log1p(counts[i]) * scale + 0.5), f);
+    }
+    fclose(f);
+}
+
+// <output>.probes.pgm and <output>.reads.pgm, replacing a .svg extension
+static void write_heatmap(const char *output_file, const HeatMap *heat) {
+    const double start = trace_now();
+    size_t stem = strlen(output_file);
+    if (stem >= 4 && strcmp(&output_file[stem - 4], ".svg") == 0) stem -= 4;
+    char *path = malloc(stem + sizeof(".probes.pgm"));
+    sprintf(path, "%.*s.probes.pgm", (int)stem, output_file);
+    write_heatmap_layer(path, heat, heat->probes);
+    sprintf(path, "%.*s.reads.pgm", (int)stem, output_file);
+    write_heatmap_layer(path, heat, heat->reads);
+    free(path);
+    trace_span("write heatmap", start, NULL);
+}
+
+static void free_heatmap(HeatMap heat) {
+    free(heat.probes);
+    free(heat.reads);
+}
+
+static long elapsed_usec(struct timespec start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000;
+}
+
+/*
+* The event log records a run so it can be inspected afterwards with ./replay
+* without slowing the generation down. It is plain text:
+*
+*   fractabubbler-events 1
+*   size <width> <height>
+*   row <value>*<count> ...     (run-length encoded initial mask, one per row)
+*   circle <x> <y> <r> <probes> <reads> <usec>
+*   block <x> <y> <r> <probes> <reads> <usec>
+*   end <circles>
+*
+* Blocks are stamped like circles but are not part of the result (see
+* --symmetry). The cost of a search is written once, with the first record
+* it produced; the other half of a mirrored pair gets zeros.
+*/
+static FILE *open_event_log(const char *path, Bitmap img) {
+    FILE *log = fopen(path, "w");
+    if (!log) {
+        fprintf(stderr, "Error: could not open event log %s\n", path);
+        exit(1);
+    }
+    fprintf(log, "fractabubbler-events 1\n");
+    fprintf(log, "size %d %d\n", img.width, img.height);
+    for (int y = 0; y < img.height; y++) {
+        const uint8_t *row = &img.data[y*img.stride];
+        fprintf(log, "row");
+        for (int x = 0; x < img.width;) {
+            int run = 1;
+            while (x + run < img.width && row[x + run] == row[x]) run++;
+            fprintf(log, " %d*%d", row[x], run);
+            x += run;
+        }
+        fprintf(log, "\n");
+    }
+    return log;
+}
+
+// Writes a circle or block record, with the cost of the search unless `stats` is NULL
+static void log_event(FILE *log, const char *kind, Circle c, const SearchStats *stats, struct timespec search_start) {
+    if (stats) {
+        fprintf(log, "%s %g %g %g %ld %ld %ld\n", kind, c.x, c.y, c.r, stats->probes, stats->reads, elapsed_usec(search_start));
+    } else {
+        fprintf(log, "%s %g %g %g 0 0 0\n", kind, c.x, c.y, c.r);
+    }
+}
+
+static void write_svg(const char *path, const Bubbles *bubbles) {
+    const double start = trace_now();
+    const Circles *circles = &bubbles->circles;
+    FILE *svg = fopen(path, "w");
+    fprintf(svg, "<?xml version=\"1.0\"?>\n");
+    fprintf(svg, "<svg width=\"%d\" height=\"%d\">\n", bubbles->width, bubbles->height);
+    if (bubbles->comment[0]) fprintf(svg, "  <!-- %s -->\n", bubbles->comment);
+    for (int i = 0; i < circles->count; i++) {
+        const Circle c = circles->items[i];
+        fprintf(svg, "  <circle cx=\"%g\" cy=\"%g\" r=\"%g\" fill=\"#800080\"", c.x, c.y, c.r);
+        if (bubbles->ranks) fprintf(svg, " data-rank=\"%u\"", bubbles->ranks[i]);
+        fprintf(svg, " />\n");
+    }
+    fprintf(svg, "</svg>\n");
+    fclose(svg);
+    trace_span("write", start, "\"circles\":%d", circles->count);
+}
+
+// Clear the pixels whose centers are inside the circle, returning how many of
+// them were still inside the glyph
+static long stamp_circle(Bitmap img, Circle c) {
+    const double start = trace_now();
+    long cleared = 0;
+    int x0, y0, x1, y1;
+    circle_bounds(img, c, &x0, &y0, &x1, &y1);
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            if ((x - c.x)*(x - c.x) + (y - c.y)*(y - c.y) < c.r*c.r) {
+                uint8_t *pixel = &img.data[y * img.stride + x];
+                cleared += *pixel != 0;
+                *pixel = 0;
+            }
+        }
+    }
+    trace_span("stamp", start, "\"r\":%g", c.r);
+    return cleared;
+}
+
+/*
+* Circle budget optimization (--circles). Starting from the greedy packing,
+* every circle in turn is lifted out of the bitmap and put back at the best
+* spot near where it was: the biggest radius that fits there and, among equal
+* radii, the spot with the most room around it. Circles drifting towards the
+* middle of their stroke leave room for their neighbours to grow on the next
+* pass. Touching pairs are also lifted out together and put back one after
+* the other, which is kept when their combined area grows. Afterwards the
+* smallest circle is traded for the biggest circle that fits anywhere for as
+* long as that is an improvement.
+*/
+#define OPTIMIZE_PASSES 8
+
+// Number of empty pixels in the disc, or LONG_MAX if it leaves the bitmap
+static long count_empty_in_disc(const Search *search, int cx, int cy, int r) {
+    const Bitmap img = search->img;
+    if (cx - r < 0 || cx + r >= img.width || cy - r < 0 || cy + r >= img.height) return LONG_MAX;
+    const int stride = img.width + 1;
+    long empty = 0;
+    for (int dy = -r; dy <= r; dy++) {
+        const int half = (int)sqrt(r*r - dy*dy);
+        const int row = (cy + dy) * stride;
+        empty += search->empty[row + cx + half + 1] - search->empty[row + cx - half];
+    }
+    return empty;
+}
+
+// Put back the original pixels under a circle. Neighbours overlapping it by
+// rounding are stamped again.
+static void unstamp_circle(Search *search, Bitmap original, const Circles *circles, int index) {
+    const Bitmap img = search->img;
+    const Circle c = circles->items[index];
+    int x0, y0, x1, y1;
+    circle_bounds(img, c, &x0, &y0, &x1, &y1);
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            if ((x - c.x)*(x - c.x) + (y - c.y)*(y - c.y) < c.r*c.r) {
+                img.data[y * img.stride + x] = original.data[y * original.stride + x];
+            }
+        }
+    }
+    search_unstamped(search, c);
+    for (int k = 0; k < circles->count; k++) {
+        const Circle other = circles->items[k];
+        const double dx = other.x - c.x, dy = other.y - c.y;
+        if (k != index && dx*dx + dy*dy < (other.r + c.r) * (other.r + c.r)) {
+            stamp_circle(img, other);
+            search_stamped(search, other);
+        }
+    }
+}
+
+static int move_reach(int r) {
+    return r / 4 > 1 ? r / 4 : 1;
+}
+
+// Best spot within `reach` pixels of c that fits at least c.r, for circles
+// still on whole pixels
+static Circle relocate_locally(Search *search, Circle c, int reach) {
+    Circle best = c;
+    long best_room = count_empty_in_disc(search, c.x, c.y, c.r + 1);
+    for (int y = c.y - reach; y <= c.y + reach; y++) {
+        for (int x = c.x - reach; x <= c.x + reach; x++) {
+            if (x < 0 || y < 0 || x >= search->img.width || y >= search->img.height) continue;
+            const int r = get_disc(search, x, y, best.r);
+            if (r < best.r) continue;
+            const long room = count_empty_in_disc(search, x, y, r + 1);
+            if (r > best.r || room < best_room) {
+                best = (Circle) { x, y, r };
+                best_room = room;
+            }
+        }
+    }
+    return best;
+}
+
+static void place_circle(Search *search, Circle c) {
+    stamp_circle(search->img, c);
+    search_stamped(search, c);
+}
+
+static bool are_touching(Circle a, Circle b) {
+    const double dx = a.x - b.x, dy = a.y - b.y, reach = a.r + b.r + 1;
+    return dx*dx + dy*dy <= reach*reach;
+}
+
+static bool improve_pair(Search *search, Bitmap original, Circles *circles, int i, int j) {
+    const Circle a = circles->items[i], b = circles->items[j];
+    unstamp_circle(search, original, circles, i);
+    circles->items[i] = (Circle) { a.x, a.y, 0 };
+    unstamp_circle(search, original, circles, j);
+
+    const Circle a2 = relocate_locally(search, a, move_reach(a.r));
+    place_circle(search, a2);
+    Circle b2 = (Circle) { b.x, b.y, get_disc(search, b.x, b.y, 1) };
+    if (b2.r >= 1) b2 = relocate_locally(search, b2, move_reach(b.r));
+
+    const bool better = b2.r >= 1 && a2.r*a2.r + b2.r*b2.r > a.r*a.r + b.r*b.r;
+    if (better) {
+        place_circle(search, b2);
+        circles->items[i] = a2;
+        circles->items[j] = b2;
+        return true;
+    }
+    circles->items[i] = a2;
+    unstamp_circle(search, original, circles, i);
+    circles->items[i] = a;
+    circles->items[j] = b;
+    place_circle(search, a);
+    place_circle(search, b);
+    return false;
+}
+
+static int by_decreasing_radius(const void *a, const void *b) {
+    const Circle *p = a, *q = b;
+    if (p->r != q->r) return p->r < q->r ? 1 : -1;
+    if (p->x != q->x) return p->x < q->x ? -1 : 1;
+    if (p->y != q->y) return p->y < q->y ? -1 : 1;
+    return 0;
+}
+
+static void optimize_circles(Search *search, Bitmap original, Circles *circles) {
+    const double start = trace_now();
+    const Bitmap img = search->img;
+    const long uncovered_before = tracing ? count_inside(img) : 0;
+    int pass = 0;
+    for (bool moved = true; moved && pass < OPTIMIZE_PASSES; pass++) {
+        moved = false;
+        for (int i = 0; i < circles->count; i++) {
+            const Circle before = circles->items[i];
+            unstamp_circle(search, original, circles, i);
+            const Circle after = relocate_locally(search, before, move_reach(before.r));
+            circles->items[i] = after;
+            place_circle(search, after);
+            moved |= after.x != before.x || after.y != before.y || after.r != before.r;
+        }
+        for (int i = 0; i < circles->count; i++) {
+            for (int j = 0; j < circles->count; j++) {
+                if (i == j || circles->items[j].r > circles->items[i].r) continue;
+                if (!are_touching(circles->items[i], circles->items[j])) continue;
+                moved |= improve_pair(search, original, circles, i, j);
+            }
+        }
+    }
+
+    for (int trades = 0; trades < circles->count && circles->count > 0; trades++) {
+        int smallest = 0;
+        for (int i = 1; i < circles->count; i++) {
+            if (circles->items[i].r < circles->items[smallest].r) smallest = i;
+        }
+        const Circle before = circles->items[smallest];
+        unstamp_circle(search, original, circles, smallest);
+        Circle c;
+        search_biggest_circle(search, &c);
+        if (c.r <= before.r) c = before;
+        circles->items[smallest] = c;
+        place_circle(search, c);
+        if (c.r == before.r) break;
+    }
+
+    qsort(circles->items, circles->count, sizeof(Circle), by_decreasing_radius);
+    trace_span("optimize", start, "\"passes\":%d,\"uncovered_before\":%ld,\"uncovered_after\":%ld",
+               pass, uncovered_before, tracing ? count_inside(img) : 0);
+}
+
+/*
+* Relaxation (--relax) moves each circle, with the others still stamped,
+* towards the peak of the distance field of the remaining free space near it:
+* the medial axis. The peak is refined between pixels by fitting a parabola
+* and the radius is the exact distance from there to the nearest empty pixel
+* center. Circles only ever grow.
+*/
+#define RELAX_PASSES 2
+
+static double parabola_peak(double before, double at, double after) {
+    const double curvature = before - 2*at + after;
+    if (curvature >= 0) return 0;
+    const double offset = (before - after) / (2 * curvature);
+    return offset < -0.5 ? -0.5 : offset > 0.5 ? 0.5 : offset;
+}
+
+static Circle relax_circle(Bitmap img, Circle c, int max_radius) {
+    const int reach = c.r / 2 > 1 ? c.r / 2 : 1;
+    const int half = reach * 2 + (int)ceil(c.r) + 2;
+    const int x0 = c.x - half < 0 ? 0 : (int)(c.x - half);
+    const int y0 = c.y - half < 0 ? 0 : (int)(c.y - half);
+    const int w = min(img.width, (int)(c.x + half) + 1) - x0;
+    const int h = min(img.height, (int)(c.y + half) + 1) - y0;
+    if (w < 3 || h < 3) return c;
+    float *field = squared_distance_field(img, x0, y0, w, h);
+
+    int px = -1, py = -1;
+    float peak = 0;
+    for (int y = 1; y < h - 1; y++) {
+        for (int x = 1; x < w - 1; x++) {
+            const double dx = x0 + x - c.x, dy = y0 + y - c.y;
+            if (dx*dx + dy*dy > reach*reach) continue;
+            if (field[y * w + x] > peak) {
+                peak = field[y * w + x];
+                px = x;
+                py = y;
+            }
+        }
+    }
+    if (px < 0) {
+        free(field);
+        return c;
+    }
+
+    #define DIST(x, y) sqrt(field[(y) * w + (x)])
+    const double cx = round((x0 + px + parabola_peak(DIST(px - 1, py), DIST(px, py), DIST(px + 1, py))) * 100) / 100;
+    const double cy = round((y0 + py + parabola_peak(DIST(px, py - 1), DIST(px, py), DIST(px, py + 1))) * 100) / 100;
+    #undef DIST
+    free(field);
+
+    // Exact distance from the refined center to the nearest empty pixel center,
+    // pixels outside the bitmap included
+    const int box = (int)ceil(sqrt(peak)) + 2;
+    double nearest = sqrt(peak) + 2;
+    for (int y = (int)cy - box; y <= (int)cy + box; y++) {
+        for (int x = (int)cx - box; x <= (int)cx + box; x++) {
+            const bool empty = x < 0 || y < 0 || x >= img.width || y >= img.height
+                               || img.data[y * img.stride + x] == 0;
+            if (!empty) continue;
+            const double d = sqrt((x - cx)*(x - cx) + (y - cy)*(y - cy));
+            if (d < nearest) nearest = d;
+        }
+    }
+    double r = floor((nearest - 0.005) * 100) / 100;
+    if (r > max_radius) r = max_radius;
+    if (r <= c.r) return c;
+    return (Circle) { cx, cy, r };
+}
+
+static void relax_circles(Search *search, Bitmap original, Circles *circles, int max_radius) {
+    const double start = trace_now();
+    int grown = 0;
+    for (int pass = 0; pass < RELAX_PASSES; pass++) {
+        for (int i = 0; i < circles->count; i++) {
+            const Circle before = circles->items[i];
+            unstamp_circle(search, original, circles, i);
+            const Circle after = relax_circle(search->img, before, max_radius);
+            circles->items[i] = after;
+            place_circle(search, after);
+            grown += after.r > before.r;
+        }
+    }
+    qsort(circles->items, circles->count, sizeof(Circle), by_decreasing_radius);
+    trace_span("relax", start, "\"grown\":%d", grown);
+}
+
+// Drop circles that cover less than `threshold` of the glyph's inside area
+static void prune_circles(Search *search, Bitmap original, Circles *circles, long inside_area, double threshold) {
+    const double start = trace_now();
+    const int before = circles->count;
+    for (int i = circles->count - 1; i >= 0; i--) {
+        const Circle c = circles->items[i];
+        long contribution = 0;
+        int x0, y0, x1, y1;
+        circle_bounds(original, c, &x0, &y0, &x1, &y1);
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                if ((x - c.x)*(x - c.x) + (y - c.y)*(y - c.y) < c.r*c.r) {
+                    contribution += original.data[y * original.stride + x] != 0;
+                }
+            }
+        }
+        if (contribution >= threshold * inside_area) continue;
+        unstamp_circle(search, original, circles, i);
+        memmove(&circles->items[i], &circles->items[i + 1], (circles->count - i - 1) * sizeof(Circle));
+        circles->count--;
+    }
+    trace_span("prune", start, "\"dropped\":%d", before - circles->count);
+}
+
+/*
+* Oversampling (--oversample). The search runs on a grid coarser than the
+* output, where rounding centers and radii to whole pixels would be visible.
+* stb_truetype's coverage is the exact area of a pixel inside the outline, so
+* a pixel at distance d from a center with coverage a puts the edge about
+* d - 0.5 + a away along the ray through it. Trying centers on a quarter
+* pixel lattice around the search's answer and keeping the one with the most
+* room recovers what the grid rounds away. Pixels cleared by other circles
+* have no coverage to go by: their circle may reach up to a pixel past their
+* center, so the edge stays that far away.
+*/
+#define SUBPIXEL_STEPS 2   // quarter pixel offsets up to half a pixel
+
+// Radius up to `reach` that stays inside the coverage around (cx, cy)
+static double coverage_room(Bitmap img, const uint8_t *stamps, double cx, double cy, double reach) {
+    double room = fmin(reach, fmin(fmin(cx + 0.5, img.width - 0.5 - cx), fmin(cy + 0.5, img.height - 0.5 - cy)));
+    int x0, y0, x1, y1;
+    circle_bounds(img, (Circle) { cx, cy, room + 0.5 }, &x0, &y0, &x1, &y1);
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            const uint8_t coverage = img.data[y * img.stride + x];
+            if (coverage == 255) continue;
+            const double d = hypot(x - cx, y - cy);
+            if (stamps[y * img.width + x]) room = fmax(0, fmin(room, d - 1));
+            else if (d - 0.5 < room) room = fmax(0, fmin(room, d - 0.5 + coverage / 255.0));
+        }
+    }
+    return room;
+}
+
+static Circle refine_subpixel(const Search *search, Circle c) {
+    const Bitmap img = search->img;
+    const double reach = fmin(c.r + 1, search->max_radius);
+    Circle best = { c.x, c.y, coverage_room(img, search->stamps, c.x, c.y, reach) };
+    for (int dy = -SUBPIXEL_STEPS; dy <= SUBPIXEL_STEPS; dy++) {
+        for (int dx = -SUBPIXEL_STEPS; dx <= SUBPIXEL_STEPS; dx++) {
+            const double x = c.x + dx * 0.5 / SUBPIXEL_STEPS, y = c.y + dy * 0.5 / SUBPIXEL_STEPS;
+            const double room = coverage_room(img, search->stamps, x, y, reach);
+            if (room > best.r) best = (Circle) { x, y, room };
+        }
+    }
+    // Stamping must clear the pixel the search found, or it finds it again
+    if ((best.x - c.x) * (best.x - c.x) + (best.y - c.y) * (best.y - c.y) >= best.r * best.r) return c;
+    return best;
+}
+
+// From grid pixels to pixels at the nominal height
+static void scale_circles(Circles *circles, double factor) {
+    for (int i = 0; i < circles->count; i++) {
+        Circle *c = &circles->items[i];
+        *c = (Circle) { (c->x + 0.5) * factor - 0.5, (c->y + 0.5) * factor - 0.5, c->r * factor };
+    }
+}
+
+/*
+* Spatial order (--spatial-order). Circles are placed largest first, so
+* neighbours in the output are scattered over the whole glyph. Sorting them
+* along a Hilbert curve puts circles close on the glyph close in the output
+* for renderers doing neighbour queries or drawing in tiles. `band` keeps the
+* radius bands (each half the radius of the one before) largest first and
+* only sorts within a band, so cutting after any band still gives the
+* biggest circles; `global` sorts the whole glyph. Either way every circle
+* keeps its rank in the largest-first order, from which a consumer gets any
+* prefix back.
+*/
+#define HILBERT_BITS 16
+
+// Distance along the Hilbert curve filling a 2^HILBERT_BITS square
+static uint64_t hilbert_index(uint32_t x, uint32_t y) {
+    const uint32_t n = 1u << HILBERT_BITS;
+    uint64_t d = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+        const uint32_t rx = (x & s) > 0, ry = (y & s) > 0;
+        d += (uint64_t)s * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            const uint32_t t = x;
+            x = y;
+            y = t;
+        }
+    }
+    return d;
+}
+
+typedef struct {
+    int band;
+    uint64_t key;
+    uint32_t rank;
+    Circle circle;
+} OrderedCircle;
+
+static int by_band_and_curve(const void *a, const void *b) {
+    const OrderedCircle *p = a, *q = b;
+    if (p->band != q->band) return p->band < q->band ? -1 : 1;
+    if (p->key != q->key) return p->key < q->key ? -1 : 1;
+    return p->rank < q->rank ? -1 : p->rank > q->rank;
+}
+
+static void order_circles(Bubbles *bubbles, SpatialOrder order) {
+    Circles *circles = &bubbles->circles;
+    if (order == ORDER_RADIUS || circles->count == 0) return;
+    const double start = trace_now();
+    OrderedCircle *ordered = malloc(circles->count * sizeof(OrderedCircle));
+    double largest = 0;  // relaxing may have grown a later circle past the first
+    for (int i = 0; i < circles->count; i++) largest = fmax(largest, circles->items[i].r);
+    // The same scale on both axes, so the curve does not stretch
+    const double scale = ((1u << HILBERT_BITS) - 1) / (double)max(1, max(bubbles->width, bubbles->height));
+    for (int i = 0; i < circles->count; i++) {
+        const Circle c = circles->items[i];
+        const double x = fmin(fmax(c.x * scale, 0), (1u << HILBERT_BITS) - 1);
+        const double y = fmin(fmax(c.y * scale, 0), (1u << HILBERT_BITS) - 1);
+        ordered[i] = (OrderedCircle) {
+            .band = order == ORDER_BAND && c.r < largest ? (int)floor(log2(largest / c.r)) : 0,
+            .key = hilbert_index((uint32_t)x, (uint32_t)y),
+            .rank = i,
+            .circle = c,
+        };
+    }
+    qsort(ordered, circles->count, sizeof(OrderedCircle), by_band_and_curve);
+    bubbles->ranks = malloc(circles->count * sizeof(uint32_t));
+    for (int i = 0; i < circles->count; i++) {
+        circles->items[i] = ordered[i].circle;
+        bubbles->ranks[i] = ordered[i].rank;
+    }
+    free(ordered);
+    trace_span("order", start, "\"circles\":%d", circles->count);
+}
+
+static void free_bubbles(Bubbles bubbles) {
+    free(bubbles.circles.items);
+    free(bubbles.ranks);
+}
+
+/*
+* Mirror symmetry (--symmetry). Glyphs like o, H, X and 8 are mirror images
+* of themselves, so the search only scans the half of the bitmap on one side
+* of the axis and every circle it finds is placed together with its mirror
+* image. Circles straddling the axis would overlap their image; they are
+* replaced by whichever covers more: one circle centered on the axis, or the
+* pair shrunk until they just touch.
+*/
+typedef enum {
+    SYMMETRY_NONE,
+    SYMMETRY_VERTICAL,    // left and right halves mirror each other
+    SYMMETRY_HORIZONTAL,  // top and bottom halves mirror each other
+} SymmetryAxis;
+
+typedef struct {
+    SymmetryAxis axis;
+    int sum;  // a coordinate v mirrors to sum - v, so the axis is at sum / 2
+} Symmetry;
+
+static inline bool is_set(Bitmap img, int x, int y) {
+    return x >= 0 && y >= 0 && x < img.width && y < img.height && img.data[y * img.stride + x] != 0;
+}
+
+static Symmetry check_symmetry(Bitmap img, SymmetryAxis axis, double tolerance) {
+    int lo = INT_MAX, hi = -1;
+    long inside = 0;
+    for (int y = 0; y < img.height; y++) {
+        for (int x = 0; x < img.width; x++) {
+            if (!is_set(img, x, y)) continue;
+            const int v = axis == SYMMETRY_VERTICAL ? x : y;
+            if (v < lo) lo = v;
+            if (v > hi) hi = v;
+            inside++;
+        }
+    }
+    const Symmetry sym = { axis, lo + hi };
+    if (inside == 0) return (Symmetry) { SYMMETRY_NONE, 0 };
+
+    long mismatched = 0;
+    for (int y = 0; y < img.height; y++) {
+        for (int x = 0; x < img.width; x++) {
+            const bool mirrored = axis == SYMMETRY_VERTICAL ? is_set(img, sym.sum - x, y) : is_set(img, x, sym.sum - y);
+            mismatched += is_set(img, x, y) && !mirrored;
+        }
+    }
+    if (mismatched > tolerance * inside) return (Symmetry) { SYMMETRY_NONE, 0 };
+    return sym;
+}
+
+static Symmetry detect_symmetry(Bitmap img, double tolerance) {
+    const double start = trace_now();
+    Symmetry sym = check_symmetry(img, SYMMETRY_VERTICAL, tolerance);
+    if (sym.axis == SYMMETRY_NONE) sym = check_symmetry(img, SYMMETRY_HORIZONTAL, tolerance);
+    trace_span("detect symmetry", start, "\"axis\":%d", sym.axis);
+    return sym;
+}
+
+// Keep only what is inside on both sides, so that circles placed in one half
+// and mirrored stay inside the glyph when it is only nearly symmetric
+static void symmetrize(Bitmap img, Symmetry sym) {
+    for (int y = 0; y < img.height; y++) {
+        for (int x = 0; x < img.width; x++) {
+            const int mx = sym.axis == SYMMETRY_VERTICAL ? sym.sum - x : x;
+            const int my = sym.axis == SYMMETRY_HORIZONTAL ? sym.sum - y : y;
+            uint8_t *pixel = &img.data[y * img.stride + x];
+            const uint8_t mirrored = mx >= 0 && my >= 0 && mx < img.width && my < img.height
+                                     ? img.data[my * img.stride + mx] : 0;
+            if (mirrored < *pixel) *pixel = mirrored;
+        }
+    }
+}
+
+static Circle mirror_circle(Symmetry sym, Circle c) {
+    if (sym.axis == SYMMETRY_VERTICAL) c.x = sym.sum - c.x;
+    else c.y = sym.sum - c.y;
+    return c;
+}
+
+// The circles to place for a circle found in the searched half: 1 or 2
+static int mirror_placement(Search *search, Symmetry sym, Circle c, Circle out[2]) {
+    const double v = sym.axis == SYMMETRY_VERTICAL ? c.x : c.y;
+    const double gap = fabs(sym.sum - 2 * v);
+    if (gap == 0) {
+        out[0] = c;
+        return 1;
+    }
+    if (gap >= 2 * c.r) {
+        out[0] = c;
+        out[1] = mirror_circle(sym, c);
+        return 2;
+    }
+
+    Circle pair = c;
+    pair.r = floor(gap / 2);
+    Circle centered = c;
+    const int axis = sym.sum / 2;
+    if (sym.axis == SYMMETRY_VERTICAL) {
+        centered.x = sym.sum / 2.0;
+        centered.r = get_disc(search, axis, c.y, 1);
+    } else {
+        centered.y = sym.sum / 2.0;
+        centered.r = get_disc(search, c.x, axis, 1);
+    }
+    // Between two pixels the disc must fit around both of its neighbours
+    if (sym.sum % 2) centered.r = centered.r > 0.5 ? centered.r - 0.5 : 0;
+
+    if (centered.r * centered.r >= 2 * pair.r * pair.r) {
+        out[0] = centered;
+        return 1;
+    }
+    out[0] = pair;
+    out[1] = mirror_circle(sym, pair);
+    return 2;
+}
+
+Bubbles fractabubble(const Program program, Bitmap img) {
+    const Symmetry sym = program.symmetry ? detect_symmetry(img, program.symmetry_tolerance) : (Symmetry) {0};
+    if (sym.axis != SYMMETRY_NONE) symmetrize(img, sym);
+
+    FILE *log = program.event_log ? open_event_log(program.event_log, img) : NULL;
+    Circles circles = {0};
+
+    // Coverage is tracked incrementally: every pixel a stamp clears was inside
+    // the glyph and not yet covered, so the sum of cleared pixels is the
+    // covered inside area.
+    const long inside_area = count_inside(img);
+    long covered_area = 0;
+
+    Bitmap original = img;
+    const bool keep_original = program.circles || program.relax || program.prune > 0;
+    if (keep_original) {
+        original.data = malloc((size_t)img.stride * img.height);
+        memcpy(original.data, img.data, (size_t)img.stride * img.height);
+    }
+
+    HeatMap heat = program.heatmap ? make_heatmap(img) : (HeatMap) {0};
+    Search search = start_search(program, img, program.heatmap ? &heat : NULL);
+    SearchStats *const stats = &search.stats;
+    if (sym.axis == SYMMETRY_VERTICAL) search.scan_width = min(img.width, sym.sum / 2 + 1);
+    if (sym.axis == SYMMETRY_HORIZONTAL) search.scan_height = min(img.height, sym.sum / 2 + 1);
+    struct timespec search_start;
+    clock_gettime(CLOCK_MONOTONIC, &search_start);
+
+    for (;;) {
+        const double pass_start = trace_now();
+        Circle c;
+        search_biggest_circle(&search, &c);
+        if (circles.count % program.trace_sample == 0) {
+            trace_span("search", pass_start, "\"pass\":%d,\"r\":%g,\"probes\":%ld", circles.count, c.r, stats->probes);
+        }
+        if (c.r < program.fineness) break;
+
+        if (program.oversample > 1 && sym.axis == SYMMETRY_NONE && program.tolerance == 0) {
+            const Circle refined = refine_subpixel(&search, c);
+            if (refined.r >= program.fineness) c = refined;
+        }
+        Circle placements[2] = { c };
+        int count = sym.axis == SYMMETRY_NONE ? 1 : mirror_placement(&search, sym, c, placements);
+        if (placements[0].r < program.fineness) {
+            // Straddling the axis left nothing big enough here; block the
+            // center (and its image) so the search moves on
+            const Circle block[2] = { { c.x, c.y, 0.5 }, mirror_circle(sym, (Circle) { c.x, c.y, 0.5 }) };
+            // (not coverage: no circle covers them)
+            for (int i = 0; i < 2; i++) {
+                stamp_circle(img, block[i]);
+                search_stamped(&search, block[i]);
+                if (log) log_event(log, "block", block[i], i == 0 ? stats : NULL, search_start);
+            }
+            count = 0;
+        }
+        for (int i = 0; i < count; i++) {
+            push_circle(&circles, placements[i]);
+            covered_area += stamp_circle(img, placements[i]);
+            search_stamped(&search, placements[i]);
+            search_placed(&search, placements[i]);
+
+            if (log) log_event(log, "circle", placements[i], i == 0 ? stats : NULL, search_start);
+        }
+        stats->probes = stats->reads = 0;
+        clock_gettime(CLOCK_MONOTONIC, &search_start);
+
+        if (program.target_coverage > 0
+            && covered_area >= program.target_coverage * inside_area) break;
+        if (program.circles && circles.count >= program.circles) break;
+    }
+
+    if (program.engine == ENGINE_APOLLONIAN) {
+        // Gaps are filled in the order they open, not strictly by size
+        qsort(circles.items, circles.count, sizeof(Circle), by_decreasing_radius);
+    }
+    if (program.circles) {
+        optimize_circles(&search, original, &circles);
+    }
+    if (program.relax) {
+        relax_circles(&search, original, &circles, program.max_radius);
+    }
+    if (program.prune > 0) {
+        prune_circles(&search, original, &circles, inside_area, program.prune);
+    }
+    if (keep_original) {
+        free(original.data);
+    }
+    end_search(&search);
+
+    Bubbles bubbles = { .width = img.width, .height = img.height };
+    double axis = sym.sum / 2.0;
+    if (program.oversample > 1) {
+        const double factor = (double)program.height / img.height;
+        scale_circles(&circles, factor);
+        bubbles.width = (int)round(img.width * factor);
+        bubbles.height = program.height;
+        axis = (axis + 0.5) * factor - 0.5;  // as scale_circles() maps the centers
+    }
+    if (sym.axis != SYMMETRY_NONE) {
+        snprintf(bubbles.comment, sizeof(bubbles.comment), "mirror symmetry used: %s = %g",
+                 sym.axis == SYMMETRY_VERTICAL ? "x" : "y", axis);
+    }
+    if (program.heatmap) {
+        write_heatmap(program.output_file, &heat);
+        free_heatmap(heat);
+    }
+
+    if (log) {
+        fprintf(log, "end %d\n", circles.count);
+        fclose(log);
+    }
+    bubbles.circles = circles;
+    order_circles(&bubbles, program.spatial_order);
+    return bubbles;
+}
+
+/*
+* Banded mode (--band-height) for glyphs too tall for one bitmap. The rows
+* are searched one band at a time, top to bottom, and only the band and a
+* halo of the rows its circles can reach (or, with adaptive fineness, see)
+* above and below are rasterized. Circles of earlier bands reaching into
+* the halo are stamped before the search, so later bands pack around them.
+* Memory is O(width x (band height + max radius)) instead of
+* O(width x height).
+*
+* The greedy order only holds within a band: a band's circles are placed
+* before a bigger circle centered in the next band is found.
+*/
+static int band_halo(const Program program) {
+    return program.max_radius + (program.interior_fineness > program.fineness ? program.fineness_ramp : 0) + 2;
+}
+
+// Rows of the glyph resident at once
+static int resident_rows(const Program program) {
+    const int height = grid_height(program);
+    if (program.band_height == 0) return height;
+    return min(height, program.band_height + 2 * band_halo(program));
+}
+
+Bubbles fractabubble_banded(const Program program) {
+    const int height = grid_height(program);
+    const GlyphLayout layout = layout_glyph(program.glyph, height);
+    const int halo = band_halo(program);
+    Circles circles = {0};
+    int reaching = 0;  // circles before this one are out of reach of the window
+
+    for (int top = 0; top < height; top += program.band_height) {
+        const double band_start = trace_now();
+        const int bottom = min(height, top + program.band_height);
+        const int window = max(0, top - halo);
+        Bitmap img = rasterize_rows(program.glyph, layout, window, min(height, bottom + halo) - window);
+        const int first = circles.count;
+
+        // Circles are kept in the window's rows while it is searched. They are
+        // stamped after start_search() so the distance field for
+        // --interior-fineness only sees the outline
+        Search search = start_search(program, img, NULL);
+        while (reaching < circles.count && circles.items[reaching].y + program.max_radius + 1 < window) reaching++;
+        if (reaching < circles.count) {
+            for (int i = reaching; i < circles.count; i++) {
+                const Circle c = circles.items[i];
+                stamp_circle(img, (Circle) { c.x, c.y - window, c.r });
+                if (search.stamps) mark_stamps(&search, (Circle) { c.x, c.y - window, c.r }, 1);
+            }
+            update_prefix_rows(&search, 0, img.height);
+        }
+        search.scan_top = top - window;
+        search.scan_height = bottom - window;
+        for (;;) {
+            Circle c;
+            search_biggest_circle(&search, &c);
+            if (c.r < program.fineness) break;
+            if (program.oversample > 1 && program.tolerance == 0) {
+                const Circle refined = refine_subpixel(&search, c);
+                if (refined.r >= program.fineness) c = refined;
+            }
+            stamp_circle(img, c);
+            search_stamped(&search, c);
+            push_circle(&circles, (Circle) { c.x, c.y + window, c.r });
+        }
+        end_search(&search);
+        free_bitmap(img);
+        trace_span("band", band_start, "\"top\":%d,\"circles\":%d", top, circles.count - first);
+    }
+
+    qsort(circles.items, circles.count, sizeof(Circle), by_decreasing_radius);
+    Bubbles bubbles = { .width = layout.width, .height = height };
+    if (program.oversample > 1) {
+        const double factor = (double)program.height / height;
+        scale_circles(&circles, factor);
+        bubbles.width = (int)round(layout.width * factor);
+        bubbles.height = program.height;
+    }
+    bubbles.circles = circles;
+    order_circles(&bubbles, program.spatial_order);
+    return bubbles;
+}
+
+/*
+* Binary atlas (--binary-atlas): atlas.bin replaces a directory's SVG files
+* and text atlas. The writer thread copies each glyph's circles straight into
+* a memory map of the file, so output costs no system call per glyph; the
+* map grows by doubling. In the machine's byte order:
+*
+*     header   AtlasHeader
+*     glyphs   an AtlasGlyph per glyph of the directory, by codepoint
+*     circles  an AtlasCircle per circle, each glyph's largest first
+*
+* With --spatial-order (ATLAS_RANKED in the header's flags) the circles are
+* in that order instead, and each glyph's circles are followed by a uint32_t
+* per circle: its rank in the largest-first order.
+*
+* With --atlas-grid (ATLAS_GRID) each glyph with circles is followed by a
+* uniform grid for hit testing without visiting every circle: an AtlasGrid,
+* a uint32_t per cell plus one, row by row, and AtlasRanges. The circles
+* overlapping cell k are the ranges from starts[k] up to starts[k + 1]. Runs
+* of consecutive circles share a range, which --spatial-order makes common.
+*
+* The glyph table is sized when the file is created, so every glyph's entry
+* is in place from the start and only circles are appended.
+*/
+#define ATLAS_MAGIC "FBATLAS"
+#define ATLAS_VERSION 1
+#define ATLAS_RANKED 1
+#define ATLAS_GRID 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t glyph_count;
+    uint32_t height;       // the nominal height all glyphs were made at
+    uint32_t flags;
+} AtlasHeader;
+
+typedef struct {
+    uint32_t codepoint;
+    uint32_t circle_count;
+    uint64_t offset;       // of the first circle from the start of the file
+    uint32_t width;        // the SVG's size; 0 for empty glyphs
+    uint32_t height;
+} AtlasGlyph;
+
+typedef struct {
+    float x, y, r;
+} AtlasCircle;
+
+typedef struct {
+    float cell;            // width and height of a cell in pixels
+    uint32_t columns;      // cells cover the glyph's width and height
+    uint32_t rows;
+    uint32_t range_count;
+} AtlasGrid;
+
+typedef struct {
+    uint32_t first, end;   // circles [first, end) in the order written
+} AtlasRange;
+
+typedef struct {
+    char path[4200];
+    int fd;
+    uint8_t *map;
+    size_t size;  // of the file and the map
+    size_t used;
+    int grid;     // rows of grid cells, 0 without grids
+} BinaryAtlas;
+
+static AtlasGlyph *atlas_glyphs(const BinaryAtlas *atlas) {
+    return (AtlasGlyph *)(atlas->map + sizeof(AtlasHeader));
+}
+
+static void resize_binary_atlas(BinaryAtlas *atlas, size_t size) {
+    uint8_t *map = atlas->map ? mremap(atlas->map, atlas->size, size, MREMAP_MAYMOVE)
+                              : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, atlas->fd, 0);
+    if (ftruncate(atlas->fd, size) != 0 || map == MAP_FAILED) {
+        fprintf(stderr, "Error: could not grow %s to %zu bytes\n", atlas->path, size);
+        exit(1);
+    }
+    atlas->map = map;
+    atlas->size = size;
+}
+
+// Written as <path>.tmp and renamed once closed, like the text atlas
+static void open_binary_atlas(BinaryAtlas *atlas, const char *directory, int glyph_count, const Program program) {
+    char temporary[4300];
+    snprintf(atlas->path, sizeof(atlas->path), "%s/atlas.bin", directory);
+    snprintf(temporary, sizeof(temporary), "%s.tmp", atlas->path);
+    atlas->fd = open(temporary, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (atlas->fd < 0) {
+        fprintf(stderr, "Error: could not open atlas %s\n", temporary);
+        exit(1);
+    }
+    atlas->map = NULL;
+    atlas->grid = program.atlas_grid;
+    atlas->used = sizeof(AtlasHeader) + glyph_count * sizeof(AtlasGlyph);
+    // Room for a few hundred circles per glyph before the first remap
+    resize_binary_atlas(atlas, atlas->used + glyph_count * 256 * sizeof(AtlasCircle));
+    AtlasHeader *header = (AtlasHeader *)atlas->map;
+    const uint32_t flags = (program.spatial_order != ORDER_RADIUS ? ATLAS_RANKED : 0) | (atlas->grid ? ATLAS_GRID : 0);
+    *header = (AtlasHeader) { ATLAS_MAGIC, ATLAS_VERSION, glyph_count, program.height, flags };
+}
+
+static bool circle_meets_cell(Circle c, const AtlasGrid *grid, int column, int row) {
+    const double dx = c.x - fmin(fmax(c.x, column * grid->cell), (column + 1) * grid->cell);
+    const double dy = c.y - fmin(fmax(c.y, row * grid->cell), (row + 1) * grid->cell);
+    return dx * dx + dy * dy < c.r * c.r;
+}
+
+// Goes over the cells every circle overlaps, counting the ranges of each cell
+// in `next` or, given `ranges`, storing them from `next` on. `last` holds the
+// end of each cell's last range. Returns the number of ranges.
+static uint32_t grid_pass(const AtlasGrid *grid, const Circles *circles, uint32_t *next, uint32_t *last, AtlasRange *ranges) {
+    uint32_t count = 0;
+    for (int k = 0; k < (int)(grid->columns * grid->rows); k++) last[k] = UINT32_MAX;
+    for (int i = 0; i < circles->count; i++) {
+        const Circle c = circles->items[i];
+        const int x0 = max(0, (int)floor((c.x - c.r) / grid->cell));
+        const int x1 = min(grid->columns - 1, (int)floor((c.x + c.r) / grid->cell));
+        const int y0 = max(0, (int)floor((c.y - c.r) / grid->cell));
+        const int y1 = min(grid->rows - 1, (int)floor((c.y + c.r) / grid->cell));
+        for (int row = y0; row <= y1; row++) {
+            for (int column = x0; column <= x1; column++) {
+                if (!circle_meets_cell(c, grid, column, row)) continue;
+                const int k = row * grid->columns + column;
+                if (last[k] == (uint32_t)i) {
+                    if (ranges) ranges[next[k] - 1].end = i + 1;
+                } else {
+                    if (ranges) ranges[next[k]] = (AtlasRange) { i, i + 1 };
+                    next[k]++;
+                    count++;
+                }
+                last[k] = i + 1;
+            }
+        }
+    }
+    return count;
+}
+
+static void append_glyph(BinaryAtlas *atlas, int slot, const Bubbles *bubbles) {
+    const double start = trace_now();
+    const int count = bubbles->circles.count;
+    const size_t circle_bytes = count * (sizeof(AtlasCircle) + (bubbles->ranks ? sizeof(uint32_t) : 0));
+    size_t bytes = circle_bytes;
+
+    AtlasGrid grid = {0};
+    uint32_t *counts = NULL, *last = NULL;
+    if (atlas->grid && count) {
+        grid.cell = (float)bubbles->height / atlas->grid;
+        grid.columns = max(1, (int)ceil(bubbles->width / grid.cell));
+        grid.rows = atlas->grid;
+        const int cells = grid.columns * grid.rows;
+        counts = calloc(cells, sizeof(uint32_t));
+        last = malloc(cells * sizeof(uint32_t));
+        grid.range_count = grid_pass(&grid, &bubbles->circles, counts, last, NULL);
+        bytes += sizeof(AtlasGrid) + (cells + 1) * sizeof(uint32_t) + grid.range_count * sizeof(AtlasRange);
+    }
+    if (atlas->used + bytes > atlas->size) {
+        size_t size = atlas->size;
+        while (atlas->used + bytes > size) size *= 2;
+        resize_binary_atlas(atlas, size);
+    }
+    AtlasCircle *circles = (AtlasCircle *)(atlas->map + atlas->used);
+    for (int i = 0; i < bubbles->circles.count; i++) {
+        const Circle c = bubbles->circles.items[i];
+        circles[i] = (AtlasCircle) { c.x, c.y, c.r };
+    }
+    if (bubbles->ranks) {
+        memcpy(&circles[bubbles->circles.count], bubbles->ranks, bubbles->circles.count * sizeof(uint32_t));
+    }
+    if (counts) {
+        AtlasGrid *header = (AtlasGrid *)(atlas->map + atlas->used + circle_bytes);
+        *header = grid;
+        const int cells = grid.columns * grid.rows;
+        uint32_t *starts = (uint32_t *)(header + 1);
+        starts[0] = 0;
+        for (int k = 0; k < cells; k++) starts[k + 1] = starts[k] + counts[k];
+        memcpy(counts, starts, cells * sizeof(uint32_t));
+        grid_pass(&grid, &bubbles->circles, counts, last, (AtlasRange *)&starts[cells + 1]);
+        free(counts);
+        free(last);
+    }
+    AtlasGlyph *glyph = &atlas_glyphs(atlas)[slot];
+    glyph->circle_count = bubbles->circles.count;
+    glyph->offset = atlas->used;
+    glyph->width = bubbles->width;
+    glyph->height = bubbles->height;
+    atlas->used += bytes;
+    trace_span("append", start, "\"circles\":%d", bubbles->circles.count);
+}
+
+static void close_binary_atlas(BinaryAtlas *atlas) {
+    char temporary[4300];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", atlas->path);
+    munmap(atlas->map, atlas->size);
+    if (ftruncate(atlas->fd, atlas->used) != 0 || close(atlas->fd) != 0 || rename(temporary, atlas->path) != 0) {
+        fprintf(stderr, "Error: could not write atlas %s\n", atlas->path);
+        exit(1);
+    }
+}
+
+/*
+* Shared memory hand-off (--publish, --subscribe). A renderer running next to
+* the generator picks up glyphs as they are made, reading the circles where
+* the writer thread put them instead of from files. The segment holds a
+* RingHeader and a ring of messages with one producer and one consumer:
+* `head` and `tail` count the bytes ever published and consumed, so each side
+* only writes its own counter and no lock is needed. A message is a
+* RingMessage followed by its AtlasCircles (and ranks, as in atlas.bin),
+* always contiguous: one that would run past the end of the ring goes to its
+* start, after a RING_WRAP message filling the rest, so a message may take at
+* most half the ring. Empty glyphs are messages without circles.
+*
+* The publisher waits while the ring is full, but only for RING_TIMEOUT
+* without the subscriber reading anything: a subscriber that never came or
+* died must not hold up the batch. Publishing then stops with a warning.
+*/
+#define RING_MAGIC "FBRING"
+#define RING_VERSION 1
+#define RING_BYTES (16 << 20)
+#define RING_WRAP UINT32_MAX
+#define RING_TIMEOUT 10000   // milliseconds
+
+enum { RING_STARTING, RING_OPEN, RING_CLOSED };
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    _Atomic uint32_t state;   // RING_OPEN once the header is valid
+    uint64_t capacity;        // bytes of messages after the header
+    _Atomic uint64_t head;    // bytes published, written by the publisher
+    _Atomic uint64_t tail;    // bytes consumed, written by the subscriber
+} RingHeader;
+
+typedef struct {
+    uint32_t size;          // bytes to the next message, a multiple of 8
+    uint32_t codepoint;     // or RING_WRAP
+    uint32_t circle_count;
+    uint32_t width;
+    uint32_t height;
+    uint32_t entry;         // line of the manifest, 0 without one
+    uint32_t face;
+    uint32_t flags;         // ATLAS_RANKED if ranks follow the circles
+    uint64_t sequence;      // 0, 1, 2, ... in publishing order
+} RingMessage;
+
+typedef struct {
+    const char *name;
+    RingHeader *header;
+    uint8_t *data;
+    uint64_t sequence;
+    bool stalled;   // the subscriber stopped reading, nothing is published
+} Ring;
+
+static void map_ring(Ring *ring, const char *name, int fd, size_t size) {
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error: could not map shared memory %s\n", name);
+        exit(1);
+    }
+    ring->header = map;
+    ring->data = (uint8_t *)map + sizeof(RingHeader);
+}
+
+// Replaces any ring of that name; subscribers of the old one keep reading it
+static void create_ring(Ring *ring, const char *name) {
+    shm_unlink(name);
+    const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 || ftruncate(fd, sizeof(RingHeader) + RING_BYTES) != 0) {
+        fprintf(stderr, "Error: could not create shared memory %s\n", name);
+        exit(1);
+    }
+    map_ring(ring, name, fd, sizeof(RingHeader) + RING_BYTES);
+    memcpy(ring->header->magic, RING_MAGIC, sizeof(RING_MAGIC));
+    ring->header->version = RING_VERSION;
+    ring->header->capacity = RING_BYTES;
+    ring->name = name;
+    ring->sequence = 0;
+    ring->stalled = false;
+    atomic_store_explicit(&ring->header->state, RING_OPEN, memory_order_release);
+}
+
+static void sleep_briefly(void) {
+    nanosleep(&(struct timespec) { .tv_nsec = 1000000 }, NULL);
+}
+
+static void publish_glyph(Ring *ring, int entry, int face, int codepoint, const Bubbles *bubbles) {
+    if (ring->stalled) return;
+    const double start = trace_now();
+    RingHeader *header = ring->header;
+    const uint64_t capacity = header->capacity;
+    const size_t rank_bytes = bubbles->ranks ? sizeof(uint32_t) : 0;
+    const uint64_t size = (sizeof(RingMessage) + bubbles->circles.count * (sizeof(AtlasCircle) + rank_bytes) + 7) & ~7ull;
+    // Anything bigger might need more than the whole ring after a wrap
+    if (size > capacity / 2) {
+        fprintf(stderr, "Error: U+%04X has too many circles to publish\n", codepoint);
+        exit(1);
+    }
+    const uint64_t head = atomic_load_explicit(&header->head, memory_order_relaxed);
+    const uint64_t skip = capacity - head % capacity < size ? capacity - head % capacity : 0;
+    uint64_t tail = atomic_load_explicit(&header->tail, memory_order_acquire);
+    for (int waited = 0; head + skip + size - tail > capacity; waited++) {
+        if (waited == RING_TIMEOUT) {
+            fprintf(stderr, "Warning: nothing reads %s, stopped publishing to it\n", ring->name);
+            ring->stalled = true;
+            return;
+        }
+        sleep_briefly();
+        const uint64_t read = atomic_load_explicit(&header->tail, memory_order_acquire);
+        if (read != tail) waited = 0;
+        tail = read;
+    }
+    if (skip) {
+        RingMessage *wrap = (RingMessage *)&ring->data[head % capacity];
+        wrap->size = skip;
+        wrap->codepoint = RING_WRAP;
+    }
+    RingMessage *message = (RingMessage *)&ring->data[(head + skip) % capacity];
+    *message = (RingMessage) {
+        .size = size,
+        .codepoint = codepoint,
+        .circle_count = bubbles->circles.count,
+        .width = bubbles->width,
+        .height = bubbles->height,
+        .entry = entry,
+        .face = face,
+        .flags = bubbles->ranks ? ATLAS_RANKED : 0,
+        .sequence = ring->sequence++,
+    };
+    AtlasCircle *circles = (AtlasCircle *)(message + 1);
+    for (int i = 0; i < bubbles->circles.count; i++) {
+        const Circle c = bubbles->circles.items[i];
+        circles[i] = (AtlasCircle) { c.x, c.y, c.r };
+    }
+    if (bubbles->ranks) {
+        memcpy(&circles[bubbles->circles.count], bubbles->ranks, bubbles->circles.count * sizeof(uint32_t));
+    }
+    atomic_store_explicit(&header->head, head + skip + size, memory_order_release);
+    trace_span("publish", start, "\"circles\":%d", bubbles->circles.count);
+}
+
+static void close_ring(Ring *ring) {
+    atomic_store_explicit(&ring->header->state, RING_CLOSED, memory_order_release);
+    munmap(ring->header, sizeof(RingHeader) + ring->header->capacity);
+}
+
+/*
+* --subscribe: waits for the ring to appear and prints every glyph published
+* to it until the publisher is done, then removes it. A renderer would read
+* the circles in place the same way.
+*/
+static void subscribe(const char *name) {
+    int fd;
+    while ((fd = shm_open(name, O_RDWR, 0)) < 0) sleep_briefly();
+    struct stat st;
+    while (fstat(fd, &st) == 0 && st.st_size < (off_t)sizeof(RingHeader)) sleep_briefly();
+    Ring ring;
+    map_ring(&ring, name, fd, sizeof(RingHeader));
+    RingHeader *header = ring.header;
+    while (atomic_load_explicit(&header->state, memory_order_acquire) == RING_STARTING) sleep_briefly();
+    if (memcmp(header->magic, RING_MAGIC, sizeof(RING_MAGIC)) != 0 || header->version != RING_VERSION) {
+        fprintf(stderr, "Error: %s is not a version %d ring\n", name, RING_VERSION);
+        exit(1);
+    }
+    const uint64_t capacity = header->capacity;
+    munmap(header, sizeof(RingHeader));
+    map_ring(&ring, name, shm_open(name, O_RDWR, 0), sizeof(RingHeader) + capacity);
+    header = ring.header;
+
+    uint64_t tail = atomic_load_explicit(&header->tail, memory_order_relaxed);
+    for (;;) {
+        const bool closed = atomic_load_explicit(&header->state, memory_order_acquire) == RING_CLOSED;
+        if (tail == atomic_load_explicit(&header->head, memory_order_acquire)) {
+            if (closed) break;
+            sleep_briefly();
+            continue;
+        }
+        const RingMessage *message = (const RingMessage *)&ring.data[tail % capacity];
+        if (message->codepoint != RING_WRAP) {
+            printf("%llu: U+%04X entry %u face %u, %u circles, %ux%u\n", (unsigned long long)message->sequence,
+                   message->codepoint, message->entry, message->face, message->circle_count,
+                   message->width, message->height);
+            fflush(stdout);
+        }
+        tail += message->size;
+        atomic_store_explicit(&header->tail, tail, memory_order_release);
+    }
+    munmap(header, sizeof(RingHeader) + capacity);
+    shm_unlink(name);
+}
+
+/*
+* Batch mode (--glyphs). A whole glyph set is rendered by one process: the
+* font is loaded once and the glyphs go through a pipeline, the most
+* expensive first so that no big glyph is left running alone at the end:
+*
+*     rasterizer --(ready queue)--> search workers --(output queue)--> writer
+*
+* The rasterizer thread admits glyphs and rasterizes them ahead of the
+* workers, so a worker goes straight from one search to the next, and the
+* writer thread formats and writes the SVGs while the searches go on. Empty
+* glyphs (spaces) never enter the pipeline and get an atlas entry without a
+* file.
+*/
+typedef struct {
+    int entry;       // which glyph set of the batch
+    int face;
+    int codepoint;
+    double cost;     // estimated from the glyph's box
+    size_t memory;   // estimated working set in bytes
+    bool empty;
+    int shard;       // from 1, when the batch is split over processes
+    int slot;        // position in its directory's atlas
+} Job;
+
+/* A font, glyph set and sizes to render: the command line's --glyphs or a
+* line of a manifest */
+typedef struct {
+    Program program;
+    const FontFile *font;
+} BatchEntry;
+
+// Faces of an entry's font it renders
+static void entry_faces(const BatchEntry *entry, int *first, int *last) {
+    *first = entry->program.all_faces ? 0 : entry->program.face;
+    *last = entry->program.all_faces ? entry->font->face_count - 1 : entry->program.face;
+}
+
+/* A glyph on its way through the pipeline. The rasterizer fills in the
+* bitmap, a worker the circles. */
+typedef struct Output {
+    _Atomic(struct Output *) next;
+    const Job *job;  // NULL tells the writer to stop
+    Program program;
+    Bitmap bitmap;
+    Bubbles bubbles;
+    char path[4200];
+} Output;
+
+/* Rasterized glyphs waiting for a worker. Bounded, so that the rasterizer
+* runs at most one bitmap per worker ahead. */
+typedef struct {
+    Output **items;
+    int capacity;
+    int head;
+    int count;
+    bool closed;  // the rasterizer is done
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} ReadyQueue;
+
+/*
+* Searched glyphs waiting for the writer: a lock-free queue with many
+* producers and one consumer (Vyukov's intrusive MPSC queue). Workers push
+* with a single atomic exchange, and never wait for the writer. The
+* semaphore counts the pushed nodes so the writer can sleep while there
+* are none.
+*/
+typedef struct {
+    _Atomic(Output *) head;  // last pushed
+    Output *tail;            // next to pop, only touched by the writer
+    Output stub;
+    sem_t pushed;
+} OutputQueue;
 
-/* A greyscale bitmap */
 typedef struct {
-    uint8_t *data;
-    int stride;
-    int width;
-    int height;
-} Bitmap;
+    const BatchEntry *entries;
+    Job *jobs;
+    int count;
+    atomic_int workers;
+    int worker_count;
+    ReadyQueue ready;
+    OutputQueue output;
 
-static inline int min(int a, int b) {
-    return a < b ? a : b;
+    // --binary-atlas: one per output directory, in the order of the entries
+    // and their faces
+    BinaryAtlas *atlases;
+    int *first_atlas;  // per entry
+    // --publish
+    Ring *ring;
+
+    // Admission control (--memory-limit): memory of the glyphs in progress
+    size_t memory_limit;
+    size_t memory_used;
+    int running;
+    bool exclusive;  // a big glyph is waiting for, or has, the batch alone
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+} Batch;
+
+/*
+* What a glyph holds while it is searched, per pixel of its bitmap: the
+* bitmap itself and whatever the options add to it. The Voronoi engine's
+* triangulation grows with the outline instead, guessed from the bitmap's
+* perimeter.
+*/
+static size_t estimate_memory(const Program program, int width, int height) {
+    const size_t pixels = (size_t)width * height;
+    size_t bytes = pixels;
+    if (program.engine == ENGINE_PREFIX || program.engine == ENGINE_APOLLONIAN) {
+        bytes += (size_t)(width + 1) * height * sizeof(int32_t) * (program.tolerance > 0 ? 3 : 1);
+    }
+    if (program.tolerance > 0 || program.oversample > 1) {
+        bytes += pixels;
+    }
+    if (program.engine == ENGINE_VORONOI) {
+        bytes += (size_t)(width + height) * 64 * (sizeof(Triangle) + sizeof(Point));
+    }
+    if (program.interior_fineness > program.fineness) {
+        // The distance field, and the transform's scratch rows while building it
+        bytes += pixels * sizeof(float) * 2;
+    }
+    if (program.circles || program.relax || program.prune > 0) bytes += pixels;
+    if (program.symmetry) bytes += pixels;
+    if (program.heatmap) bytes += pixels * 2 * sizeof(uint32_t);
+    return bytes;
 }
 
-// Optimized midpoint circle algorithm
-// https://en.wikipedia.org/wiki/Midpoint_circle_algorithm#Jesko's_Method
-static bool is_circle_in_image(Bitmap img, int cx, int cy, int r) {
-    int x = r;  
-    int y = 0;
-    int t1 = r / 16;
-    int t2 = 0;
-    while (y <= x) {
-        if (img.data[(cy + y) * img.stride + (cx + x)] == 0) return false;
-        if (img.data[(cy - y) * img.stride + (cx + x)] == 0) return false;
-        if (img.data[(cy + y) * img.stride + (cx - x)] == 0) return false;
-        if (img.data[(cy - y) * img.stride + (cx - x)] == 0) return false;
-        if (img.data[(cy + x) * img.stride + (cx + y)] == 0) return false;
-        if (img.data[(cy + x) * img.stride + (cx - y)] == 0) return false;
-        if (img.data[(cy - x) * img.stride + (cx + y)] == 0) return false;
-        if (img.data[(cy - x) * img.stride + (cx - y)] == 0) return false;
-        y++;
-        t1 = t1 + y;
-        t2 = t1 - x;
-        if (t2 >= 0) {
-            t1 = t2;
-            x--;
+static const struct {
+    const char *name;
+    int first, last;
+} glyph_presets[] = {
+    { "ascii", 0x20, 0x7e },
+    { "latin1", 0x20, 0xff },
+    { "latin-ext-a", 0x100, 0x17f },
+    { "greek", 0x370, 0x3ff },
+    { "cyrillic", 0x400, 0x4ff },
+    { "cjk", 0x4e00, 0x9fff },
+    { "all", 0, 0x10ffff },
+};
+
+static bool is_valid_glyph_set(const char *set) {
+    char *buffer = strdup(set);
+    bool valid = true;
+    for (char *item = strtok(buffer, ","); item && valid; item = strtok(NULL, ",")) {
+        bool known = false;
+        for (size_t i = 0; i < sizeof(glyph_presets) / sizeof(*glyph_presets) && !known; i++) {
+            known = strcmp(item, glyph_presets[i].name) == 0;
         }
+        if (known) continue;
+        char *end;
+        const long first = strtol(item, &end, 0);
+        long last = first;
+        if (*end == '-') last = strtol(end + 1, &end, 0);
+        valid = first > 0 && last >= first && *end == '\0';
     }
-    return true;
+    free(buffer);
+    return valid;
 }
 
-static double get_circle(const Bitmap img, int px, int py, int r) {
-    if (px - r < 0 || px + r >= img.width
-        || py - r < 0 || py + r >= img.height) return r-1;
-
-    if (!is_circle_in_image(img, px, py, r)) return r-1;
+static int by_glyph(const void *a, const void *b) {
+    const Job *ja = a, *jb = b;
+    if (ja->entry != jb->entry) return ja->entry - jb->entry;
+    return ja->face != jb->face ? ja->face - jb->face : ja->codepoint - jb->codepoint;
+}
 
-    return get_circle(img, px, py, r+1);
+static int by_decreasing_cost(const void *a, const void *b) {
+    const double ca = ((const Job *)a)->cost, cb = ((const Job *)b)->cost;
+    // Ties in glyph order, so that every process sees the same order
+    return ca != cb ? (ca < cb) - (ca > cb) : by_glyph(a, b);
 }
 
-static int find_biggest_circle(const Bitmap img, int *const out_x, int *const out_y) {
-    double greatest_radius = 0;
-    for (int x = 0; x < img.width; x++) {
-        for (int y = 0; y < img.height; y++) {
-            double r = get_circle(img, x, y, 0);
-            if (r > greatest_radius) {
-                greatest_radius = r;
-                *out_x = x;
-                *out_y = y;
+// Appends every codepoint of the set that the face has a glyph for
+static void collect_jobs(const BatchEntry *entry, int index, int face, Job **out, int *count, int *capacity) {
+    const Program program = entry->program;
+    font = &entry->font->faces[face];
+    Job *jobs = *out;
+    const float scale = stbtt_ScaleForPixelHeight(font, grid_height(program));
+    char *buffer = strdup(program.glyph_set);
+    for (char *item = strtok(buffer, ","); item; item = strtok(NULL, ",")) {
+        int first = 0, last = -1;
+        for (size_t i = 0; i < sizeof(glyph_presets) / sizeof(*glyph_presets); i++) {
+            if (strcmp(item, glyph_presets[i].name) == 0) {
+                first = glyph_presets[i].first;
+                last = glyph_presets[i].last;
+            }
+        }
+        if (last < 0) {
+            char *end;
+            first = last = strtol(item, &end, 0);
+            if (*end == '-') last = strtol(end + 1, NULL, 0);
+        }
+        for (int c = first; c <= last; c++) {
+            const int glyph = stbtt_FindGlyphIndex(font, c);
+            if (glyph == 0) continue;
+            if (*count == *capacity) {
+                *capacity = *capacity ? *capacity * 2 : 256;
+                jobs = realloc(jobs, *capacity * sizeof(Job));
             }
+            int x0 = 0, y0 = 0, x1 = 0, y1 = 0, advance;
+            const bool empty = stbtt_IsGlyphEmpty(font, glyph);
+            if (!empty) stbtt_GetGlyphBox(font, glyph, &x0, &y0, &x1, &y1);
+            stbtt_GetGlyphHMetrics(font, glyph, &advance, NULL);
+            // The search scans every pixel and tests radii up to the stroke
+            // width, so bigger boxes cost more than their area alone
+            const double area = (x1 - x0) * scale * (y1 - y0) * scale;
+            const int width = (int)(fmax(advance, x1) * scale) + 1;
+            const size_t memory = empty ? 0 : estimate_memory(program, width, resident_rows(program));
+            jobs[(*count)++] = (Job) {
+                .entry = index,
+                .face = face,
+                .codepoint = c,
+                .cost = area * sqrt(area),
+                .memory = memory,
+                .empty = empty,
+            };
         }
     }
-    return greatest_radius;
+    free(buffer);
+    *out = jobs;
 }
 
+// Every face gets its own directory when all of them are rendered
+static void face_directory(char *path, size_t size, const Program program, int face) {
+    if (program.all_faces) snprintf(path, size, "%s/face%d", program.out_dir, face);
+    else snprintf(path, size, "%s", program.out_dir);
+}
 
-#define SIZE (1<<25)
-stbtt_fontinfo font;
-uint8_t ttf_buffer[SIZE];
+static void make_directory(const char *path) {
+    if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: could not create %s\n", path);
+        exit(1);
+    }
+}
 
-Bitmap rasterize_glyph(const char *file_name, int c, int height) {
-    FILE* f = fopen(file_name, "rb");
-    assert(f);
+static void glyph_file_name(char *name, size_t size, int codepoint) {
+    snprintf(name, size, "u%04X.svg", codepoint);
+}
 
-    fread(ttf_buffer, 1, SIZE, f);
-    fclose(f);
-    
-    stbtt_InitFont(&font, ttf_buffer, stbtt_GetFontOffsetForIndex(ttf_buffer,0));
-    float scale = stbtt_ScaleForPixelHeight(&font, height);
+// Blocks until the job fits next to the ones in progress. Returns whether it
+// has the batch to itself: glyphs needing more than half the limit wait for
+// every other glyph to finish and keep new ones out meanwhile.
+static bool admit_job(Batch *batch, const Job *job) {
+    if (batch->memory_limit == 0) return false;
+    const double start = trace_now();
+    const bool big = job->memory > batch->memory_limit / 2;
+    pthread_mutex_lock(&batch->lock);
+    if (big) {
+        while (batch->exclusive) pthread_cond_wait(&batch->finished, &batch->lock);
+        batch->exclusive = true;
+        while (batch->running > 0) pthread_cond_wait(&batch->finished, &batch->lock);
+        if (job->memory > batch->memory_limit) {
+            fprintf(stderr, "Warning: U+%04X needs about %zu MB, more than the memory limit\n",
+                    job->codepoint, job->memory >> 20);
+        }
+    } else {
+        while (batch->exclusive || batch->memory_used + job->memory > batch->memory_limit) {
+            pthread_cond_wait(&batch->finished, &batch->lock);
+        }
+    }
+    batch->memory_used += job->memory;
+    batch->running++;
+    pthread_mutex_unlock(&batch->lock);
+    trace_span("admit", start, "\"glyph\":%d,\"mb\":%zu", job->codepoint, job->memory >> 20);
+    return big;
+}
 
-    int ascent;
-    stbtt_GetFontVMetrics(&font, &ascent, NULL, NULL);
+static void finish_job(Batch *batch, const Job *job) {
+    if (batch->memory_limit == 0) return;
+    pthread_mutex_lock(&batch->lock);
+    batch->memory_used -= job->memory;
+    batch->running--;
+    if (job->memory > batch->memory_limit / 2) batch->exclusive = false;
+    pthread_cond_broadcast(&batch->finished);
+    pthread_mutex_unlock(&batch->lock);
+}
 
-    int width;
-    stbtt_GetCodepointHMetrics(&font, c, &width, NULL);
-    width = (int)(width * scale);
+// Waits show up as "idle" spans on the waiting thread's track
+static void push_ready(ReadyQueue *queue, Output *glyph) {
+    const double start = trace_now();
+    bool waited = false;
+    pthread_mutex_lock(&queue->lock);
+    for (; queue->count == queue->capacity; waited = true) pthread_cond_wait(&queue->changed, &queue->lock);
+    queue->items[(queue->head + queue->count++) % queue->capacity] = glyph;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    if (waited) trace_span("idle", start, NULL);
+}
 
-    uint8_t* bitmap = calloc(width*height, 1);
+// NULL once the rasterizer is done and the queue is empty
+static Output *pop_ready(ReadyQueue *queue) {
+    const double start = trace_now();
+    bool waited = false;
+    pthread_mutex_lock(&queue->lock);
+    for (; queue->count == 0 && !queue->closed; waited = true) pthread_cond_wait(&queue->changed, &queue->lock);
+    Output *glyph = NULL;
+    if (queue->count > 0) {
+        glyph = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    if (waited) trace_span("idle", start, NULL);
+    return glyph;
+}
 
-    int x0,y0,x1,y1;
-    stbtt_GetCodepointBitmapBox(&font, c, scale, scale, &x0, &y0, &x1, &y1);
-    /* printf("%d, %d, %d, %d\n", x0, y0, x1, y1); */
+static void close_ready(ReadyQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = true;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
 
-    int baseline = (int) (ascent*scale);
-    stbtt_MakeCodepointBitmap(&font, &bitmap[(baseline + y0) * width + x0], x1-x0,y1-y0, width, scale,scale, c);
+static void init_output_queue(OutputQueue *queue) {
+    atomic_init(&queue->stub.next, NULL);
+    atomic_init(&queue->head, &queue->stub);
+    queue->tail = &queue->stub;
+    sem_init(&queue->pushed, 0, 0);
+}
 
-    return (Bitmap) {
-        .data = bitmap,
-        .stride = width,
-        .width = width,
-        .height = height,
-    };
+static void link_output(OutputQueue *queue, Output *node) {
+    atomic_store(&node->next, NULL);
+    Output *previous = atomic_exchange(&queue->head, node);
+    atomic_store(&previous->next, node);
 }
 
-Bitmap make_bitmap(const Program program) {
-    return rasterize_glyph(program.font, program.glyph, program.height);
+static void push_output(OutputQueue *queue, Output *node) {
+    link_output(queue, node);
+    sem_post(&queue->pushed);
 }
 
-void free_bitmap(Bitmap bitmap) {
-    free(bitmap.data);
+// Waits for the next node. A producer is briefly between its exchange and
+// linking the node in; the writer then yields until the link shows up.
+static Output *pop_output(OutputQueue *queue) {
+    if (sem_trywait(&queue->pushed) != 0) {
+        const double start = trace_now();
+        sem_wait(&queue->pushed);
+        trace_span("idle", start, NULL);
+    }
+    for (;;) {
+        Output *tail = queue->tail;
+        Output *next = atomic_load(&tail->next);
+        if (tail == &queue->stub) {
+            if (!next) {
+                sched_yield();
+                continue;
+            }
+            queue->tail = tail = next;
+            next = atomic_load(&tail->next);
+        }
+        if (next) {
+            queue->tail = next;
+            return tail;
+        }
+        if (tail == atomic_load(&queue->head)) {
+            // The last node can only be taken with something behind it
+            link_output(queue, &queue->stub);
+            next = atomic_load(&tail->next);
+            if (next) {
+                queue->tail = next;
+                return tail;
+            }
+        }
+        sched_yield();
+    }
 }
 
-void display_ascii(Bitmap img) {
-    for (int y = 0; y < img.height; y++) {
-        for (int x = 0; x < img.width; x++) {
-            int c = " .:*|oO@"[img.data[y*img.stride + x]>>5];
-            putchar(c);
-            putchar(c);
+static void *batch_rasterizer(void *arg) {
+    Batch *batch = arg;
+    trace_thread_name("rasterizer");
+    for (int i = 0; i < batch->count; i++) {
+        const Job *job = &batch->jobs[i];
+        if (job->empty && !batch->ring) continue;
+        Output *glyph = calloc(1, sizeof(Output));
+        glyph->job = job;
+        if (job->empty) {
+            // Straight to the writer, only to be published
+            push_output(&batch->output, glyph);
+            continue;
+        }
+        char name[32], directory[4096];
+        glyph_file_name(name, sizeof(name), job->codepoint);
+        const BatchEntry *entry = &batch->entries[job->entry];
+        if (entry->program.out_dir) {
+            face_directory(directory, sizeof(directory), entry->program, job->face);
+            snprintf(glyph->path, sizeof(glyph->path), "%s/%s", directory, name);
+        }
+        glyph->program = entry->program;
+        glyph->program.glyph = job->codepoint;
+        glyph->program.output_file = glyph->path;
+        const bool alone = admit_job(batch, job);
+        if (alone && glyph->program.search_threads < batch->worker_count) {
+            glyph->program.search_threads = batch->worker_count;
         }
-        putchar('\n');
+        font = &entry->font->faces[job->face];
+        // Banded glyphs rasterize their bands as they go
+        if (!glyph->program.band_height) glyph->bitmap = make_bitmap(glyph->program);
+        push_ready(&batch->ready, glyph);
     }
-    fflush(stdout);
+    close_ready(&batch->ready);
+    return NULL;
 }
 
-void fractabubble(const Program program, Bitmap img) {
-    if (program.debug_ascii_display) {
-        display_ascii(img);
+static void *batch_worker(void *arg) {
+    Batch *batch = arg;
+    trace_thread_name("worker %d", atomic_fetch_add(&batch->workers, 1));
+    Output *glyph;
+    while ((glyph = pop_ready(&batch->ready)) != NULL) {
+        const Job *job = glyph->job;
+        font = &batch->entries[job->entry].font->faces[job->face];
+        if (glyph->program.band_height) {
+            glyph->bubbles = fractabubble_banded(glyph->program);
+        } else {
+            glyph->bubbles = fractabubble(glyph->program, glyph->bitmap);
+            free_bitmap(glyph->bitmap);
+        }
+        // The circles left to write are small next to the search's memory
+        finish_job(batch, job);
+        push_output(&batch->output, glyph);
     }
+    return NULL;
+}
 
-    FILE *svg = fopen(program.output_file, "w");
-    fprintf(svg, "<?xml version=\"1.0\"?>\n");
-    fprintf(svg, "<svg width=\"%d\" height=\"%d\">\n", img.width, img.height);
+static void *batch_writer(void *arg) {
+    Batch *batch = arg;
+    trace_thread_name("writer");
+    for (;;) {
+        Output *glyph = pop_output(&batch->output);
+        if (!glyph->job) break;
+        const Job *job = glyph->job;
+        if (batch->ring) publish_glyph(batch->ring, job->entry, job->face, job->codepoint, &glyph->bubbles);
+        // Empty glyphs are already in the atlas and have no file (no path)
+        if (batch->atlases && !job->empty) {
+            int first, last;
+            entry_faces(&batch->entries[job->entry], &first, &last);
+            append_glyph(&batch->atlases[batch->first_atlas[job->entry] + job->face - first], job->slot, &glyph->bubbles);
+        } else if (glyph->path[0]) {
+            write_svg(glyph->path, &glyph->bubbles);
+        }
+        free_bubbles(glyph->bubbles);
+        free(glyph);
+    }
+    return NULL;
+}
+
+// Where a shard's atlas goes (shard 0: the whole batch's)
+static void atlas_path(char *path, size_t size, const Program program, int face, int shard, int shard_count) {
+    char directory[4096];
+    face_directory(directory, sizeof(directory), program, face);
+    if (shard) snprintf(path, size, "%s/atlas.%d-of-%d", directory, shard, shard_count);
+    else snprintf(path, size, "%s/atlas", directory);
+}
+
+// Written in the same format gen.lua always used: a blank line, the
+// codepoint and the file name per glyph. Empty glyphs have no file: "-".
+// A shard's atlas starts with a "shard <i>/<n>" line. The file only
+// appears under its name once complete, so an interrupted run leaves none.
+static void write_atlas(const Program program, int entry, int face, const Job *jobs, int count, int shard, int shard_count) {
+    char path[4200], temporary[4300];
+    atlas_path(path, sizeof(path), program, face, shard, shard_count);
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    FILE *f = fopen(temporary, "w");
+    if (!f) {
+        fprintf(stderr, "Error: could not open atlas %s\n", temporary);
+        exit(1);
+    }
+    if (shard) fprintf(f, "shard %d/%d\n", shard, shard_count);
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].entry != entry || jobs[i].face != face) continue;
+        char name[32] = "-";
+        if (!jobs[i].empty) glyph_file_name(name, sizeof(name), jobs[i].codepoint);
+        fprintf(f, "\n%d\n%s\n", jobs[i].codepoint, name);
+    }
+    if (fclose(f) != 0 || rename(temporary, path) != 0) {
+        fprintf(stderr, "Error: could not write atlas %s\n", path);
+        exit(1);
+    }
+}
 
-    int greatest_radius;
-    int x_greatest, y_greatest;
+// Every glyph of every entry and face once, the most expensive first
+static Job *plan_batch(const BatchEntry *entries, int entry_count, int *count) {
+    Job *jobs = NULL;
+    int capacity = 0;
+    *count = 0;
+    for (int e = 0; e < entry_count; e++) {
+        int first, last;
+        entry_faces(&entries[e], &first, &last);
+        for (int face = first; face <= last; face++) {
+            collect_jobs(&entries[e], e, face, &jobs, count, &capacity);
+        }
+    }
+    qsort(jobs, *count, sizeof(Job), by_glyph);
+    int unique = 0;
+    for (int i = 0; i < *count; i++) {
+        if (unique == 0 || by_glyph(&jobs[unique - 1], &jobs[i]) != 0) {
+            jobs[unique++] = jobs[i];
+        }
+    }
+    *count = unique;
+    for (int i = 0; i < *count; i++) {
+        const bool same_directory = i > 0 && jobs[i - 1].entry == jobs[i].entry && jobs[i - 1].face == jobs[i].face;
+        jobs[i].slot = same_directory ? jobs[i - 1].slot + 1 : 0;
+    }
+    qsort(jobs, *count, sizeof(Job), by_decreasing_cost);
+    return jobs;
+}
 
-    while ((greatest_radius = find_biggest_circle(img, &x_greatest, &y_greatest)) >= program.fineness) {
-        const int p_x = x_greatest, p_y = y_greatest, r = greatest_radius;
+/*
+* Splits a batch over processes (--shard). Every process plans the whole
+* batch, in the same order, and deals the glyphs out the same way: each to
+* the shard with the least estimated cost so far, the most expensive first.
+* So the shards finish at about the same time without talking to each other.
+*/
+static void assign_shards(Job *jobs, int count, int shard_count) {
+    double *load = calloc(shard_count, sizeof(double));
+    for (int i = 0; i < count; i++) {
+        int least = 0;
+        for (int shard = 1; shard < shard_count; shard++) {
+            if (load[shard] < load[least]) least = shard;
+        }
+        load[least] += jobs[i].cost;
+        jobs[i].shard = least + 1;
+    }
+    free(load);
+}
 
-        fprintf(svg, "  <circle cx=\"%d\" cy=\"%d\" r=\"%d\" fill=\"#800080\" />\n", p_x, p_y, r);
-        for (int j = -r; j < r; j++) {
-            for (int i = -r; i < r; i++) {
-                if (j*j + i*i < r*r) {
-                    img.data[(p_y + j) * img.stride + (p_x + i)] = 0;
+// All entries, faces and glyphs go through one queue and one pool of
+// workers, so that small fonts don't leave workers idle at their tail
+static void run_batch(const BatchEntry *entries, int entry_count, int workers, int memory_limit) {
+    Batch batch = {
+        .entries = entries,
+        .memory_limit = (size_t)memory_limit << 20,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .finished = PTHREAD_COND_INITIALIZER,
+    };
+    for (int e = 0; e < entry_count && entries[0].program.out_dir; e++) {
+        int first, last;
+        entry_faces(&entries[e], &first, &last);
+        make_directory(entries[e].program.out_dir);
+        for (int face = first; face <= last; face++) {
+            char directory[4096];
+            face_directory(directory, sizeof(directory), entries[e].program, face);
+            make_directory(directory);
+        }
+    }
+    batch.jobs = plan_batch(entries, entry_count, &batch.count);
+    const int shard = entries[0].program.shard, shard_count = entries[0].program.shard_count;
+    if (shard) {
+        assign_shards(batch.jobs, batch.count, shard_count);
+        int mine = 0;
+        for (int i = 0; i < batch.count; i++) {
+            if (batch.jobs[i].shard == shard) batch.jobs[mine++] = batch.jobs[i];
+        }
+        batch.count = mine;
+    }
+    if (entries[0].program.binary_atlas) {
+        int atlas_count = 0;
+        batch.first_atlas = malloc(entry_count * sizeof(int));
+        for (int e = 0; e < entry_count; e++) {
+            int first, last;
+            entry_faces(&entries[e], &first, &last);
+            batch.first_atlas[e] = atlas_count;
+            atlas_count += last - first + 1;
+        }
+        batch.atlases = calloc(atlas_count, sizeof(BinaryAtlas));
+        for (int e = 0; e < entry_count; e++) {
+            int first, last;
+            entry_faces(&entries[e], &first, &last);
+            for (int face = first; face <= last; face++) {
+                int glyph_count = 0;
+                for (int i = 0; i < batch.count; i++) {
+                    glyph_count += batch.jobs[i].entry == e && batch.jobs[i].face == face;
+                }
+                char directory[4096];
+                face_directory(directory, sizeof(directory), entries[e].program, face);
+                BinaryAtlas *atlas = &batch.atlases[batch.first_atlas[e] + face - first];
+                open_binary_atlas(atlas, directory, glyph_count, entries[e].program);
+                for (int i = 0; i < batch.count; i++) {
+                    if (batch.jobs[i].entry == e && batch.jobs[i].face == face) {
+                        atlas_glyphs(atlas)[batch.jobs[i].slot].codepoint = batch.jobs[i].codepoint;
+                    }
                 }
             }
         }
+    }
 
-        if (program.debug_ascii_display) {
-            double seconds = 0.1;
-            struct timespec req = { .tv_nsec = 1e9 * seconds };
-            nanosleep(&req, NULL);
-            display_ascii(img);
-            fflush(stdout);
+    Ring ring;
+    if (entries[0].program.publish) {
+        create_ring(&ring, entries[0].program.publish);
+        batch.ring = &ring;
+    }
+
+    workers = min(workers, batch.count > 0 ? batch.count : 1);
+    batch.worker_count = workers;
+    batch.ready = (ReadyQueue) {
+        .items = malloc(workers * sizeof(Output *)),
+        .capacity = workers,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .changed = PTHREAD_COND_INITIALIZER,
+    };
+    init_output_queue(&batch.output);
+    pthread_t rasterizer, writer;
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+    pthread_create(&rasterizer, NULL, batch_rasterizer, &batch);
+    pthread_create(&writer, NULL, batch_writer, &batch);
+    for (int i = 0; i < workers; i++) {
+        pthread_create(&threads[i], NULL, batch_worker, &batch);
+    }
+    pthread_join(rasterizer, NULL);
+    for (int i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    Output stop = { .job = NULL };
+    push_output(&batch.output, &stop);
+    pthread_join(writer, NULL);
+    sem_destroy(&batch.output.pushed);
+    free(batch.ready.items);
+    free(threads);
+    if (batch.ring) close_ring(batch.ring);
+    qsort(batch.jobs, batch.count, sizeof(Job), by_glyph);
+    for (int e = 0; e < entry_count && entries[0].program.out_dir; e++) {
+        int first, last;
+        entry_faces(&entries[e], &first, &last);
+        for (int face = first; face <= last; face++) {
+            if (batch.atlases) close_binary_atlas(&batch.atlases[batch.first_atlas[e] + face - first]);
+            else write_atlas(entries[e].program, e, face, batch.jobs, batch.count, shard, shard_count);
+        }
+    }
+    free(batch.atlases);
+    free(batch.first_atlas);
+    free(batch.jobs);
+}
+
+// Reads a shard's atlas, checking every glyph in it against the plan
+static void read_shard_atlas(const Program program, int entry, int face, int shard, int shard_count,
+                             Job *jobs, int count, bool *seen) {
+    char path[4200];
+    atlas_path(path, sizeof(path), program, face, shard, shard_count);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Error: %s is missing, shard %d/%d has not finished\n", path, shard, shard_count);
+        exit(1);
+    }
+    int header_shard, header_count;
+    if (fscanf(f, "shard %d/%d", &header_shard, &header_count) != 2
+        || header_shard != shard || header_count != shard_count) {
+        fprintf(stderr, "Error: %s is not the atlas of shard %d/%d\n", path, shard, shard_count);
+        exit(1);
+    }
+    int codepoint;
+    char name[32];
+    while (fscanf(f, " %d %31s", &codepoint, name) == 2) {
+        const Job key = { .entry = entry, .face = face, .codepoint = codepoint };
+        Job *job = bsearch(&key, jobs, count, sizeof(Job), by_glyph);
+        char expected[32] = "-";
+        if (job && !job->empty) glyph_file_name(expected, sizeof(expected), codepoint);
+        if (!job || job->shard != shard || strcmp(name, expected) != 0) {
+            fprintf(stderr, "Error: %s lists U+%04X, which is not shard %d/%d's as planned here;"
+                            " were the shards run with other options?\n", path, codepoint, shard, shard_count);
+            exit(1);
+        }
+        seen[job - jobs] = true;
+    }
+    if (!feof(f)) {
+        fprintf(stderr, "Error: %s is malformed\n", path);
+        exit(1);
+    }
+    fclose(f);
+}
+
+/*
+* --merge-shards: given the options the shards ran with, checks that their
+* atlases together list every glyph of the batch exactly where it was
+* planned, that every glyph's file exists, and writes the whole atlas.
+*/
+static void merge_shards(const BatchEntry *entries, int entry_count) {
+    const int shard_count = entries[0].program.merge_shards;
+    int count;
+    Job *jobs = plan_batch(entries, entry_count, &count);
+    assign_shards(jobs, count, shard_count);
+    qsort(jobs, count, sizeof(Job), by_glyph);
+    bool *seen = calloc(count, sizeof(bool));
+    for (int e = 0; e < entry_count; e++) {
+        int first, last;
+        entry_faces(&entries[e], &first, &last);
+        for (int face = first; face <= last; face++) {
+            for (int shard = 1; shard <= shard_count; shard++) {
+                read_shard_atlas(entries[e].program, e, face, shard, shard_count, jobs, count, seen);
+            }
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        char directory[4096], name[32], path[4200];
+        face_directory(directory, sizeof(directory), entries[jobs[i].entry].program, jobs[i].face);
+        glyph_file_name(name, sizeof(name), jobs[i].codepoint);
+        snprintf(path, sizeof(path), "%s/%s", directory, name);
+        if (!seen[i]) {
+            fprintf(stderr, "Error: U+%04X is missing from the atlas of shard %d/%d in %s\n",
+                    jobs[i].codepoint, jobs[i].shard, shard_count, directory);
+            exit(1);
         }
+        if (!jobs[i].empty && access(path, F_OK) != 0) {
+            fprintf(stderr, "Error: %s is missing\n", path);
+            exit(1);
+        }
+    }
+    for (int e = 0; e < entry_count; e++) {
+        int first, last;
+        entry_faces(&entries[e], &first, &last);
+        for (int face = first; face <= last; face++) {
+            write_atlas(entries[e].program, e, face, jobs, count, 0, 0);
+        }
+    }
+    free(seen);
+    free(jobs);
+}
 
+static Program resolve_sizes(Program args);
 
+/*
+* A manifest lists one batch entry per line, the other options apply to all:
+*
+*     # font                          glyphs       height  fineness  out-dir
+*     fonts/LiberationSans-Regular.ttf ascii,greek  256     4         out/sans
+*     fonts/LiberationMono-Regular.ttf ascii        128     -         out/mono
+*
+* A fineness of "-" keeps the default. Fonts used by several lines are
+* loaded once.
+*/
+static BatchEntry *load_manifest(const Program base, int *count) {
+    FILE *f = fopen(base.manifest, "r");
+    if (!f) {
+        fprintf(stderr, "Error: could not open manifest %s\n", base.manifest);
+        exit(1);
     }
+    BatchEntry *entries = NULL;
+    FontFile **fonts = NULL;
+    int capacity = 0, font_count = 0, line_number = 0;
+    *count = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), f)) {
+        line_number++;
+        char font_path[1024], glyphs[256], fineness[16], out_dir[1024];
+        int height;
+        if (line[strspn(line, " \t\r\n")] == '\0' || line[strspn(line, " \t")] == '#') continue;
+        if (sscanf(line, "%1023s %255s %d %15s %1023s", font_path, glyphs, &height, fineness, out_dir) != 5
+            || height <= 0 || height < base.oversample || !is_valid_glyph_set(glyphs)
+            || (strcmp(fineness, "-") != 0 && atoi(fineness) <= 0)) {
+            fprintf(stderr, "Error: %s:%d: expected <font> <glyphs> <height> <fineness> <out-dir>\n", base.manifest, line_number);
+            exit(1);
+        }
+        const FontFile *font_file = NULL;
+        for (int i = 0; i < font_count && !font_file; i++) {
+            if (strcmp(fonts[i]->path, font_path) == 0) font_file = fonts[i];
+        }
+        if (!font_file) {
+            fonts = realloc(fonts, (font_count + 1) * sizeof(FontFile *));
+            fonts[font_count] = malloc(sizeof(FontFile));
+            *fonts[font_count] = load_font(strdup(font_path));
+            font_file = fonts[font_count++];
+        }
+        check_face(font_file, base.face);
+        // Entries sharing a directory would overwrite each other's atlas
+        const size_t length = strlen(out_dir);
+        if (length > 1 && out_dir[length - 1] == '/') out_dir[length - 1] = '\0';
+        for (int e = 0; e < *count; e++) {
+            if (strcmp(entries[e].program.out_dir, out_dir) == 0) {
+                fprintf(stderr, "Error: %s:%d: %s is already the output directory of another line\n",
+                        base.manifest, line_number, out_dir);
+                exit(1);
+            }
+        }
 
-    fprintf(svg, "</svg>\n");
-    fclose(svg);
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            entries = realloc(entries, capacity * sizeof(BatchEntry));
+        }
+        Program program = base;
+        program.font = font_file->path;
+        program.glyph_set = strdup(glyphs);
+        program.height = height;
+        program.fineness = strcmp(fineness, "-") == 0 ? base.fineness : atoi(fineness);
+        program.out_dir = strdup(out_dir);
+        entries[(*count)++] = (BatchEntry) { resolve_sizes(program), font_file };
+    }
+    fclose(f);
+    free(fonts);
+    return entries;
 }
 
 static const char *arg0;
 static void usage(int exitcode) {
     fprintf(stderr, "Usage:\n\t%s --font <file> --glyph <codepoint> --out <output> [--fineness <number>]\n", arg0);
+    fprintf(stderr, "\t%s --font <file> --glyphs <set> --out-dir <directory> [--jobs <number>] ...\n", arg0);
     fprintf(stderr, "Example:\n\t%s --font fonts/LiberationSans-Regular.ttf --glyph 0x263a --out happy.svg --fineness 3\n", arg0);
+    fprintf(stderr, "\t%s --font fonts/LiberationSans-Regular.ttf --glyphs ascii,greek,0x2190-0x21ff --out-dir out\n", arg0);
     fprintf(stderr, "Specification:\n");
     fprintf(stderr, "\t--font <file>\n");
     fprintf(stderr, "\t\tLocal path to the ttf font file to use.\n");
@@ -219,10 +3841,112 @@ static void usage(int exitcode) {
     fprintf(stderr, "\t\tUnicode codepoint to convert in hex (0x prefix), decimal, or octal (0 prefix) form.\n");
     fprintf(stderr, "\t--out <output>\n");
     fprintf(stderr, "\t\tOutput SVG file path.\n");
+    fprintf(stderr, "\t--glyphs <set>\n");
+    fprintf(stderr, "\t\tInstead of --glyph and --out: comma separated presets (ascii, latin1,\n");
+    fprintf(stderr, "\t\tlatin-ext-a, greek, cyrillic, cjk, all), codepoints and first-last\n");
+    fprintf(stderr, "\t\tranges. Glyphs the font lacks are skipped.\n");
+    fprintf(stderr, "\t--out-dir <directory>\n");
+    fprintf(stderr, "\t\tWith --glyphs: where to write uXXXX.svg per glyph and the atlas.\n");
+    fprintf(stderr, "\t[--jobs <number>]\n");
+    fprintf(stderr, "\t\tDefault the number of processors. Worker threads for --glyphs.\n");
+    fprintf(stderr, "\t--manifest <file>\n");
+    fprintf(stderr, "\t\tInstead of --font, --glyphs and --out-dir: render the glyph sets listed\n");
+    fprintf(stderr, "\t\tas \"<font> <glyphs> <height> <fineness|-> <out-dir>\" lines with one\n");
+    fprintf(stderr, "\t\tpool of workers.\n");
+    fprintf(stderr, "\t[--memory-limit <megabytes>]\n");
+    fprintf(stderr, "\t\tBatch mode: only start a glyph once the estimated memory of all glyphs\n");
+    fprintf(stderr, "\t\tin progress fits. Glyphs needing more than half run alone, searched\n");
+    fprintf(stderr, "\t\tby all workers.\n");
+    fprintf(stderr, "\t[--shard <index>/<count>]\n");
+    fprintf(stderr, "\t\tBatch mode: render only this share of the glyphs, for splitting a batch\n");
+    fprintf(stderr, "\t\tover processes or machines, and write atlas.<index>-of-<count>.\n");
+    fprintf(stderr, "\t[--merge-shards <count>]\n");
+    fprintf(stderr, "\t\tBatch mode, with the options the shards ran with: check that all the\n");
+    fprintf(stderr, "\t\tshards finished and merge their atlases into the atlas.\n");
+    fprintf(stderr, "\t[--binary-atlas]\n");
+    fprintf(stderr, "\t\tBatch mode: write each output directory's circles into one binary\n");
+    fprintf(stderr, "\t\tatlas.bin instead of an SVG file per glyph and the text atlas.\n");
+    fprintf(stderr, "\t[--atlas-grid <rows>]\n");
+    fprintf(stderr, "\t\tWith --binary-atlas: store a grid of this many rows of square cells\n");
+    fprintf(stderr, "\t\twith each glyph, listing the circles overlapping each cell.\n");
+    fprintf(stderr, "\t[--publish <name>]\n");
+    fprintf(stderr, "\t\tBatch mode: also hand every glyph's circles to a process on this machine\n");
+    fprintf(stderr, "\t\tthrough the shared memory ring /<name>. --out-dir becomes optional. Stops\n");
+    fprintf(stderr, "\t\tpublishing if nothing reads the full ring for 10 seconds.\n");
+    fprintf(stderr, "\t--subscribe <name>\n");
+    fprintf(stderr, "\t\tInstead of rendering: print the glyphs published to /<name> as they\n");
+    fprintf(stderr, "\t\tarrive, until the publisher is done.\n");
+    fprintf(stderr, "\t[--search-threads <number>]\n");
+    fprintf(stderr, "\t\tDefault 1. Threads searching a single glyph, each scanning a band of\n");
+    fprintf(stderr, "\t\tcolumns. Prefix and apollonian engines only.\n");
+    fprintf(stderr, "\t[--face <index>]\n");
+    fprintf(stderr, "\t\tDefault 0. Face of a font collection (.ttc) to use.\n");
+    fprintf(stderr, "\t[--all-faces]\n");
+    fprintf(stderr, "\t\tWith --glyphs: render every face of the collection into face<N>\n");
+    fprintf(stderr, "\t\tdirectories under the output directory, each with its own atlas.\n");
     fprintf(stderr, "\t[--fineness <number>]\n");
     fprintf(stderr, "\t\tDefault %d. How small the circles can get (1 = pixel fine).\n", DEFAULT_FINENESS);
+    fprintf(stderr, "\t[--interior-fineness <number>]\n");
+    fprintf(stderr, "\t\tHow small the circles can get away from the outline. The fineness\n");
+    fprintf(stderr, "\t\tthen only applies next to it. Prefix and apollonian engines only.\n");
+    fprintf(stderr, "\t[--fineness-ramp <number>]\n");
+    fprintf(stderr, "\t\tDefault 2x the interior fineness. Distance in pixels from the outline\n");
+    fprintf(stderr, "\t\tover which the fineness changes to the interior fineness.\n");
     fprintf(stderr, "\t[--height <number>]\n");
     fprintf(stderr, "\t\tDefault %d. Height of the image.\n", DEFAULT_HEIGHT);
+    fprintf(stderr, "\t[--oversample <number>]\n");
+    fprintf(stderr, "\t\tSearch a grid this many times coarser than the height and place the\n");
+    fprintf(stderr, "\t\tcircles between its pixels from the antialiased coverage. Sizes are\n");
+    fprintf(stderr, "\t\tstill given at the full height.\n");
+    fprintf(stderr, "\t[--engine prefix|perimeter|apollonian|voronoi]\n");
+    fprintf(stderr, "\t\tDefault prefix. How the biggest circle is searched for: binary search\n");
+    fprintf(stderr, "\t\tover row prefix counts, or growing the radius one perimeter at a time.\n");
+    fprintf(stderr, "\t\tApollonian searches like prefix, then computes the circles filling the\n");
+    fprintf(stderr, "\t\tgaps between touching circles and the vector outline. Voronoi finds the\n");
+    fprintf(stderr, "\t\tlargest empty circles between samples of the vector outline.\n");
+    fprintf(stderr, "\t[--gap-radius <number>]\n");
+    fprintf(stderr, "\t\tDefault 3x the fineness. Below this radius the apollonian engine fills\n");
+    fprintf(stderr, "\t\tgaps instead of searching.\n");
+    fprintf(stderr, "\t[--tolerance <fraction>]\n");
+    fprintf(stderr, "\t\tAccept circles whose summed uncovered (antialiased) coverage is below\n");
+    fprintf(stderr, "\t\tthis fraction (below 1) of their area, without overlapping other circles.\n");
+    fprintf(stderr, "\t\tFewer, larger circles. Prefix engine only.\n");
+    fprintf(stderr, "\t[--max-radius <number>]\n");
+    fprintf(stderr, "\t\tDefault %d%% of the height. Largest radius a circle may have.\n", (int)(MAX_CIRCLE_RADIUS_PERCENT * 100));
+    fprintf(stderr, "\t[--band-height <number>]\n");
+    fprintf(stderr, "\t\tSearch the glyph in bands of this many rows, keeping only a band and\n");
+    fprintf(stderr, "\t\tthe rows its circles reach in memory. For heights too big for one\n");
+    fprintf(stderr, "\t\tbitmap. Prefix engine only.\n");
+    fprintf(stderr, "\t[--circles <number>]\n");
+    fprintf(stderr, "\t\tProduce at most this many circles, moving and growing them afterwards\n");
+    fprintf(stderr, "\t\tfor the best coverage. Fineness defaults to 1. Prefix engine only.\n");
+    fprintf(stderr, "\t[--relax]\n");
+    fprintf(stderr, "\t\tAfterwards move circles off the pixel grid towards the middle of their\n");
+    fprintf(stderr, "\t\tfree space so they can grow.\n");
+    fprintf(stderr, "\t[--prune <fraction>]\n");
+    fprintf(stderr, "\t\tAfterwards drop circles covering less than this fraction of the glyph.\n");
+    fprintf(stderr, "\t[--symmetry]\n");
+    fprintf(stderr, "\t\tDetect mirror symmetry about a vertical or horizontal axis, search only\n");
+    fprintf(stderr, "\t\tone half and mirror the circles. Prefix engine only, and not with\n");
+    fprintf(stderr, "\t\t--circles, --relax or --prune.\n");
+    fprintf(stderr, "\t[--symmetry-tolerance <fraction>]\n");
+    fprintf(stderr, "\t\tFraction of inside pixels that may break the symmetry (default exact).\n");
+    fprintf(stderr, "\t[--spatial-order band|global]\n");
+    fprintf(stderr, "\t\tWrite the circles along a Hilbert curve within each radius band, or over\n");
+    fprintf(stderr, "\t\tthe whole glyph, each with its rank in the largest-first order.\n");
+    fprintf(stderr, "\t[--target-coverage <fraction>]\n");
+    fprintf(stderr, "\t\tStop once this fraction (0 to 1) of the glyph is covered, even if\n");
+    fprintf(stderr, "\t\tlarger circles than the fineness would still fit.\n");
+    fprintf(stderr, "\t[--event-log <file>]\n");
+    fprintf(stderr, "\t\tRecord the initial mask and every placed circle with its search\n");
+    fprintf(stderr, "\t\tstatistics. View it afterwards with ./replay.\n");
+    fprintf(stderr, "\t[--heatmap]\n");
+    fprintf(stderr, "\t\tWrite <output>.probes.pgm and <output>.reads.pgm showing where the\n");
+    fprintf(stderr, "\t\tsearch spent its circle probes and bitmap reads over the run.\n");
+    fprintf(stderr, "\t[--trace <file>]\n");
+    fprintf(stderr, "\t\tWrite a Chrome trace-event JSON file (chrome://tracing, Perfetto).\n");
+    fprintf(stderr, "\t[--trace-sample <number>]\n");
+    fprintf(stderr, "\t\tDefault 1. Only trace every nth search pass.\n");
     exit(exitcode);
 }
 
@@ -253,12 +3977,80 @@ static int get_number(const char *item) {
     return number;
 }
 
+static int get_index(const char *item) {
+    item = get_string(item);
+    char *end;
+    const long index = strtol(item, &end, 0);
+    if (*end != '\0' || index < 0 || index > INT_MAX) {
+        fprintf(stderr, "Error: expected a non-negative index (got %s)\n", item);
+        usage(1);
+    }
+    return index;
+}
+
+// Shared memory names are "/name"
+static const char *get_ring_name(const char *item) {
+    item = get_string(item);
+    if (item[0] == '\0' || strchr(item, '/') || strlen(item) > NAME_MAX - 1) {
+        fprintf(stderr, "Error: expected a shared memory name without slashes (got %s)\n", item);
+        usage(1);
+    }
+    char *name = malloc(strlen(item) + 2);
+    sprintf(name, "/%s", item);
+    return name;
+}
+
+// "<i>/<n>", 1 <= i <= n
+static void get_shard(const char *item, int *shard, int *shard_count) {
+    item = get_string(item);
+    int length = 0;
+    if (sscanf(item, "%d/%d%n", shard, shard_count, &length) != 2 || item[length] != '\0'
+        || *shard < 1 || *shard > *shard_count) {
+        fprintf(stderr, "Error: expected a shard as <index>/<count> from 1/<count> (got %s)\n", item);
+        usage(1);
+    }
+}
+
+static Engine get_engine(const char *item) {
+    item = get_string(item);
+    if (strcmp(item, "perimeter") == 0) return ENGINE_PERIMETER;
+    if (strcmp(item, "prefix") == 0) return ENGINE_PREFIX;
+    if (strcmp(item, "apollonian") == 0) return ENGINE_APOLLONIAN;
+    if (strcmp(item, "voronoi") == 0) return ENGINE_VORONOI;
+    fprintf(stderr, "Error: unknown engine (%s)\n", item);
+    usage(1);
+    return ENGINE_PREFIX;
+}
+
+static SpatialOrder get_spatial_order(const char *item) {
+    item = get_string(item);
+    if (strcmp(item, "band") == 0) return ORDER_BAND;
+    if (strcmp(item, "global") == 0) return ORDER_GLOBAL;
+    fprintf(stderr, "Error: unknown spatial order (%s)\n", item);
+    usage(1);
+    return ORDER_RADIUS;
+}
+
+static double get_fraction(const char *item) {
+    item = get_string(item);
+    char *end;
+    double fraction = strtod(item, &end);
+    if (*end != '\0' || !(fraction > 0 && fraction <= 1)) {
+        fprintf(stderr, "Error: expected a fraction between 0 and 1 (got %s)\n", item);
+        usage(1);
+    }
+    return fraction;
+}
+
 static Program collect_args(char **argv) {
     arg0 = *argv++;
     char *item;
     Program args = {0};
-    args.fineness = DEFAULT_FINENESS;
     args.height = DEFAULT_HEIGHT;
+    args.trace_sample = 1;
+    args.oversample = 1;
+    args.search_threads = 1;
+    args.engine = ENGINE_PREFIX;
     while ((item = *argv++) != NULL) {
         const char *key = get_key(item);
         if (strcmp(key, "font") == 0) {
@@ -267,40 +4059,284 @@ static Program collect_args(char **argv) {
             args.glyph = get_number(*argv++);
         } else if (strcmp(key, "out") == 0) {
             args.output_file = get_string(*argv++);
+        } else if (strcmp(key, "glyphs") == 0) {
+            args.glyph_set = get_string(*argv++);
+        } else if (strcmp(key, "out-dir") == 0) {
+            args.out_dir = get_string(*argv++);
+        } else if (strcmp(key, "jobs") == 0) {
+            args.jobs = get_number(*argv++);
+        } else if (strcmp(key, "search-threads") == 0) {
+            args.search_threads = get_number(*argv++);
+        } else if (strcmp(key, "memory-limit") == 0) {
+            args.memory_limit = get_number(*argv++);
+        } else if (strcmp(key, "shard") == 0) {
+            get_shard(*argv++, &args.shard, &args.shard_count);
+        } else if (strcmp(key, "merge-shards") == 0) {
+            args.merge_shards = get_number(*argv++);
+        } else if (strcmp(key, "binary-atlas") == 0) {
+            args.binary_atlas = true;
+        } else if (strcmp(key, "atlas-grid") == 0) {
+            args.atlas_grid = get_number(*argv++);
+        } else if (strcmp(key, "publish") == 0) {
+            args.publish = get_ring_name(*argv++);
+        } else if (strcmp(key, "subscribe") == 0) {
+            args.subscribe = get_ring_name(*argv++);
+        } else if (strcmp(key, "manifest") == 0) {
+            args.manifest = get_string(*argv++);
+        } else if (strcmp(key, "face") == 0) {
+            args.face = get_index(*argv++);
+        } else if (strcmp(key, "all-faces") == 0) {
+            args.all_faces = true;
         } else if (strcmp(key, "fineness") == 0) {
             args.fineness = get_number(*argv++);
+        } else if (strcmp(key, "interior-fineness") == 0) {
+            args.interior_fineness = get_number(*argv++);
+        } else if (strcmp(key, "fineness-ramp") == 0) {
+            args.fineness_ramp = get_number(*argv++);
         } else if (strcmp(key, "height") == 0) {
             args.height = get_number(*argv++);
+        } else if (strcmp(key, "oversample") == 0) {
+            args.oversample = get_number(*argv++);
+        } else if (strcmp(key, "engine") == 0) {
+            args.engine = get_engine(*argv++);
+        } else if (strcmp(key, "gap-radius") == 0) {
+            args.gap_radius = get_number(*argv++);
+        } else if (strcmp(key, "tolerance") == 0) {
+            args.tolerance = get_fraction(*argv++);
+        } else if (strcmp(key, "max-radius") == 0) {
+            args.max_radius = get_number(*argv++);
+        } else if (strcmp(key, "band-height") == 0) {
+            args.band_height = get_number(*argv++);
+        } else if (strcmp(key, "circles") == 0) {
+            args.circles = get_number(*argv++);
+        } else if (strcmp(key, "relax") == 0) {
+            args.relax = true;
+        } else if (strcmp(key, "prune") == 0) {
+            args.prune = get_fraction(*argv++);
+        } else if (strcmp(key, "symmetry") == 0) {
+            args.symmetry = true;
+        } else if (strcmp(key, "symmetry-tolerance") == 0) {
+            args.symmetry = true;
+            args.symmetry_tolerance = get_fraction(*argv++);
+        } else if (strcmp(key, "spatial-order") == 0) {
+            args.spatial_order = get_spatial_order(*argv++);
+        } else if (strcmp(key, "target-coverage") == 0) {
+            args.target_coverage = get_fraction(*argv++);
         } else if (strcmp(key, "help") == 0) {
             usage(0);
-        } else if (strcmp(key, "debug-ascii-display") == 0) {
-            args.debug_ascii_display = true;
+        } else if (strcmp(key, "event-log") == 0) {
+            args.event_log = get_string(*argv++);
+        } else if (strcmp(key, "heatmap") == 0) {
+            args.heatmap = true;
+        } else if (strcmp(key, "trace") == 0) {
+            args.trace_file = get_string(*argv++);
+        } else if (strcmp(key, "trace-sample") == 0) {
+            args.trace_sample = get_number(*argv++);
         } else {
             fprintf(stderr, "Error: unknown argument (%s)\n", key);
             usage(1);
         }
     }
 
-    if (args.font == NULL) {
+    if (args.subscribe) {
+        if (args.font || args.manifest || args.publish) {
+            fprintf(stderr, "Error: --subscribe only reads what another process publishes\n");
+            usage(1);
+        }
+        return args;
+    }
+    if (args.manifest) {
+        if (args.font || args.glyph || args.glyph_set || args.output_file || args.out_dir) {
+            fprintf(stderr, "Error: --manifest replaces --font, --glyph(s), --out and --out-dir\n");
+            usage(1);
+        }
+    } else if (args.font == NULL) {
         fprintf(stderr, "Error: missing font\n");
         usage(1);
     }
-    if (args.glyph == 0) {
-        fprintf(stderr, "Error: missing glyph\n");
+    if (args.glyph_set && (args.glyph || args.output_file)) {
+        fprintf(stderr, "Error: --glyphs replaces --glyph and --out\n");
+        usage(1);
+    }
+    if (args.glyph_set && !is_valid_glyph_set(args.glyph_set)) {
+        fprintf(stderr, "Error: unknown glyph set (%s)\n", args.glyph_set);
+        usage(1);
+    }
+    if (args.glyph_set && args.out_dir == NULL && !args.publish) {
+        fprintf(stderr, "Error: missing output directory\n");
+        usage(1);
+    }
+    if (args.glyph_set && args.out_dir == NULL
+        && (args.binary_atlas || args.shard || args.merge_shards || args.heatmap)) {
+        fprintf(stderr, "Error: --binary-atlas, --shard, --merge-shards and --heatmap write to --out-dir\n");
+        usage(1);
+    }
+    if (args.atlas_grid && !args.binary_atlas) {
+        fprintf(stderr, "Error: --atlas-grid requires --binary-atlas\n");
+        usage(1);
+    }
+    if (args.glyph_set || args.manifest) {
+        if (args.shard && args.merge_shards) {
+            fprintf(stderr, "Error: --merge-shards runs after the shards, not as one\n");
+            usage(1);
+        }
+        if (args.binary_atlas && (args.shard || args.merge_shards)) {
+            fprintf(stderr, "Error: --binary-atlas writes a single atlas, not shards of one\n");
+            usage(1);
+        }
+        if (args.event_log) {
+            fprintf(stderr, "Error: --event-log records a single glyph\n");
+            usage(1);
+        }
+        if (args.jobs == 0) {
+            args.jobs = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+        }
+    } else {
+        if (args.all_faces) {
+            fprintf(stderr, "Error: --all-faces requires --glyphs\n");
+            usage(1);
+        }
+        if (args.memory_limit) {
+            fprintf(stderr, "Error: --memory-limit requires --glyphs or --manifest\n");
+            usage(1);
+        }
+        if (args.shard || args.merge_shards || args.binary_atlas || args.publish) {
+            fprintf(stderr, "Error: --shard, --merge-shards, --binary-atlas and --publish require --glyphs or --manifest\n");
+            usage(1);
+        }
+        if (args.glyph == 0) {
+            fprintf(stderr, "Error: missing glyph\n");
+            usage(1);
+        }
+        if (args.output_file == NULL) {
+            fprintf(stderr, "Error: missing output file\n");
+            usage(1);
+        }
+    }
+    if (args.interior_fineness && args.engine != ENGINE_PREFIX && args.engine != ENGINE_APOLLONIAN) {
+        fprintf(stderr, "Error: --interior-fineness requires the prefix or apollonian engine\n");
+        usage(1);
+    }
+    if (args.symmetry && args.engine != ENGINE_PREFIX) {
+        fprintf(stderr, "Error: --symmetry requires the prefix engine\n");
         usage(1);
     }
-    if (args.output_file == NULL) {
-        fprintf(stderr, "Error: missing output file\n");
+    if (args.symmetry && (args.circles || args.relax || args.prune > 0)) {
+        // They move, grow and drop circles one at a time, breaking the pairs
+        fprintf(stderr, "Error: --symmetry cannot be combined with --circles, --relax or --prune\n");
         usage(1);
     }
+    if (args.circles && args.engine != ENGINE_PREFIX) {
+        fprintf(stderr, "Error: --circles requires the prefix engine\n");
+        usage(1);
+    }
+    if (args.tolerance > 0 && args.engine != ENGINE_PREFIX) {
+        fprintf(stderr, "Error: --tolerance requires the prefix engine\n");
+        usage(1);
+    }
+    if (args.tolerance >= 1) {
+        // Every disc would fit, however far outside the glyph
+        fprintf(stderr, "Error: --tolerance must be below 1\n");
+        usage(1);
+    }
+    if (args.search_threads > 1 && args.engine != ENGINE_PREFIX && args.engine != ENGINE_APOLLONIAN) {
+        fprintf(stderr, "Error: --search-threads requires the prefix or apollonian engine\n");
+        usage(1);
+    }
+    if (args.heatmap && args.engine == ENGINE_VORONOI) {
+        fprintf(stderr, "Error: --heatmap does not apply to the voronoi engine, which does not probe pixels\n");
+        usage(1);
+    }
+    if (args.gap_radius && args.engine != ENGINE_APOLLONIAN) {
+        fprintf(stderr, "Error: --gap-radius requires the apollonian engine\n");
+        usage(1);
+    }
+    if (args.oversample > args.height) {
+        fprintf(stderr, "Error: --oversample must not exceed the height\n");
+        usage(1);
+    }
+    if (args.band_height) {
+        if (args.engine != ENGINE_PREFIX) {
+            fprintf(stderr, "Error: --band-height requires the prefix engine\n");
+            usage(1);
+        }
+        if (args.circles || args.relax || args.prune > 0 || args.symmetry || args.target_coverage > 0
+            || args.event_log || args.heatmap) {
+            fprintf(stderr, "Error: --band-height never holds the whole glyph, which --circles, --relax,\n"
+                            "--prune, --symmetry, --target-coverage, --event-log and --heatmap need\n");
+            usage(1);
+        }
+    }
+
+    return args;
+}
 
+// Fills in the sizes left at 0 from the height and converts them to the
+// search grid; done per manifest entry since their heights differ
+static Program resolve_sizes(Program args) {
+    if (args.fineness == 0) {
+        // With a budget the circle count, not the size, decides when to stop
+        args.fineness = args.circles ? 1 : DEFAULT_FINENESS;
+    }
+    if (args.fineness_ramp == 0) {
+        args.fineness_ramp = 2 * args.interior_fineness;
+    }
+    if (args.max_radius == 0) {
+        args.max_radius = args.height * MAX_CIRCLE_RADIUS_PERCENT;
+    }
+    if (args.oversample > 1) {
+        // Sizes are given at the nominal height, the search works on the grid
+        const int n = args.oversample;
+        args.fineness = (args.fineness + n / 2) / n > 1 ? (args.fineness + n / 2) / n : 1;
+        // Sizes that were set stay set: 0 turns their feature off
+        if (args.interior_fineness) args.interior_fineness = max(1, (args.interior_fineness + n / 2) / n);
+        if (args.fineness_ramp) args.fineness_ramp = max(1, (args.fineness_ramp + n / 2) / n);
+        if (args.gap_radius) args.gap_radius = max(1, (args.gap_radius + n / 2) / n);
+        args.max_radius = args.max_radius / n > 1 ? args.max_radius / n : 1;
+        if (args.band_height) args.band_height = max(1, args.band_height / n);
+    }
     return args;
 }
 
 int main(int argc, char **argv) {
     (void)argc;
     const Program program = collect_args(argv);
-    Bitmap bitmap = make_bitmap(program);
-    fractabubble(program, bitmap);
-    free_bitmap(bitmap);
+    if (program.subscribe) {
+        subscribe(program.subscribe);
+        return 0;
+    }
+    if (program.trace_file) {
+        start_tracing();
+        trace_thread_name("main");
+    }
+    if (program.manifest) {
+        int count;
+        BatchEntry *entries = load_manifest(program, &count);
+        if (program.merge_shards) merge_shards(entries, count);
+        else run_batch(entries, count, program.jobs, program.memory_limit);
+        free(entries);
+        write_trace(program.trace_file);
+        return 0;
+    }
+    const FontFile font_file = load_font(program.font);
+    check_face(&font_file, program.face);
+    font = &font_file.faces[program.face];
+    if (program.glyph_set) {
+        const BatchEntry entry = { resolve_sizes(program), &font_file };
+        if (program.merge_shards) merge_shards(&entry, 1);
+        else run_batch(&entry, 1, program.jobs, program.memory_limit);
+    } else {
+        const Program glyph = resolve_sizes(program);
+        Bubbles bubbles;
+        if (glyph.band_height) {
+            bubbles = fractabubble_banded(glyph);
+        } else {
+            Bitmap bitmap = make_bitmap(glyph);
+            bubbles = fractabubble(glyph, bitmap);
+            free_bitmap(bitmap);
+        }
+        write_svg(glyph.output_file, &bubbles);
+        free_bubbles(bubbles);
+    }
+    write_trace(program.trace_file);
 }
@@ -0,0 +1,216 @@
+/*
+* Replays an event log recorded with `fractabubbler --event-log <file>`.
+*
+* The generation itself runs at full speed while recording; this viewer
+* reconstructs the bitmap afterwards and renders it as ascii art at any
+* frame rate, or jumps straight to the state after a given iteration.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    double x, y, r;
+    bool block;      // stamped, but not a circle of the result
+    long probes;
+    long reads;
+    long usec;
+} Event;
+
+typedef struct {
+    uint8_t *mask;
+    int width;
+    int height;
+    Event *events;
+    int count;
+    int circles;     // events that are not blocks
+} Log;
+
+typedef struct {
+    const char *log_file;
+    double fps;
+    int iteration;   // -1 to play everything
+    int every;       // render every nth frame
+} Options;
+
+static void load_log(const char *path, Log *log) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Error: could not open %s\n", path);
+        exit(1);
+    }
+    int version;
+    if (fscanf(f, " fractabubbler-events %d", &version) != 1 || version != 1) {
+        fprintf(stderr, "Error: %s is not a version 1 event log\n", path);
+        exit(1);
+    }
+    if (fscanf(f, " size %d %d", &log->width, &log->height) != 2) {
+        fprintf(stderr, "Error: %s is missing the size record\n", path);
+        exit(1);
+    }
+    log->mask = calloc((size_t)log->width * log->height, 1);
+
+    for (int y = 0; y < log->height; y++) {
+        int matched = 0;
+        if (fscanf(f, " row%n", &matched) == EOF || matched == 0) break;
+        uint8_t *row = &log->mask[y * log->width];
+        int x = 0, value, run;
+        while (x < log->width && fscanf(f, " %d*%d", &value, &run) == 2) {
+            if (run > log->width - x) run = log->width - x;
+            memset(&row[x], value, run);
+            x += run;
+        }
+    }
+
+    int capacity = 256;
+    log->events = malloc(capacity * sizeof(Event));
+    log->count = 0;
+    log->circles = 0;
+    Event e;
+    char kind[8];
+    while (fscanf(f, " %7s %lf %lf %lf %ld %ld %ld", kind, &e.x, &e.y, &e.r, &e.probes, &e.reads, &e.usec) == 7) {
+        if (strcmp(kind, "circle") == 0) e.block = false;
+        else if (strcmp(kind, "block") == 0) e.block = true;
+        else break;
+        if (!e.block) log->circles++;
+        if (log->count == capacity) {
+            capacity *= 2;
+            log->events = realloc(log->events, capacity * sizeof(Event));
+        }
+        log->events[log->count++] = e;
+    }
+    fclose(f);
+}
+
+// Must stamp exactly like fractabubble() does: clear the pixels whose
+// centers are inside the circle
+static void stamp(Log *log, const Event *e) {
+    for (int y = 0; y < log->height; y++) {
+        if (fabs(y - e->y) >= e->r) continue;
+        for (int x = 0; x < log->width; x++) {
+            if ((x - e->x)*(x - e->x) + (y - e->y)*(y - e->y) < e->r*e->r) {
+                log->mask[y * log->width + x] = 0;
+            }
+        }
+    }
+}
+
+static void display_ascii(const Log *log) {
+    for (int y = 0; y < log->height; y++) {
+        for (int x = 0; x < log->width; x++) {
+            int c = " .:*|oO@"[log->mask[y*log->width + x]>>5];
+            putchar(c);
+            putchar(c);
+        }
+        putchar('\n');
+    }
+}
+
+// Event i is the nth circle
+static void display_event(const Log *log, int i, int n) {
+    const Event *e = &log->events[i];
+    printf("circle %d/%d at (%g, %g) r=%g: %ld probes, %ld reads, %ld us\n",
+           n, log->circles, e->x, e->y, e->r, e->probes, e->reads, e->usec);
+}
+
+// Totals over the first `upto` events, which hold `circles` circles
+static void display_totals(const Log *log, int upto, int circles) {
+    long probes = 0, reads = 0, usec = 0;
+    for (int i = 0; i < upto; i++) {
+        probes += log->events[i].probes;
+        reads += log->events[i].reads;
+        usec += log->events[i].usec;
+    }
+    printf("%d circles: %ld probes, %ld reads, %.3f s searching\n", circles, probes, reads, usec / 1e6);
+}
+
+static void sleep_frame(double fps) {
+    if (fps <= 0) return;
+    double seconds = 1.0 / fps;
+    struct timespec req = { .tv_sec = (time_t)seconds, .tv_nsec = 1e9 * (seconds - (time_t)seconds) };
+    nanosleep(&req, NULL);
+}
+
+static const char *arg0;
+static void usage(int exitcode) {
+    fprintf(stderr, "Usage:\n\t%s <event-log> [--fps <number>] [--every <number>] [--iteration <number>]\n", arg0);
+    fprintf(stderr, "Specification:\n");
+    fprintf(stderr, "\t[--fps <number>]\n");
+    fprintf(stderr, "\t\tDefault 10. Frames per second, 0 renders as fast as possible.\n");
+    fprintf(stderr, "\t[--every <number>]\n");
+    fprintf(stderr, "\t\tDefault 1. Only render every nth circle.\n");
+    fprintf(stderr, "\t[--iteration <number>]\n");
+    fprintf(stderr, "\t\tJump straight to the state after this many circles and exit.\n");
+    exit(exitcode);
+}
+
+static Options collect_args(char **argv) {
+    arg0 = *argv++;
+    Options options = { .fps = 10, .iteration = -1, .every = 1 };
+    char *item;
+    while ((item = *argv++) != NULL) {
+        if (strcmp(item, "--fps") == 0 && *argv) {
+            options.fps = strtod(*argv++, NULL);
+        } else if (strcmp(item, "--every") == 0 && *argv) {
+            options.every = atoi(*argv++);
+        } else if (strcmp(item, "--iteration") == 0 && *argv) {
+            options.iteration = atoi(*argv++);
+        } else if (strcmp(item, "--help") == 0) {
+            usage(0);
+        } else if (item[0] != '-' && options.log_file == NULL) {
+            options.log_file = item;
+        } else {
+            fprintf(stderr, "Error: unexpected argument (%s)\n", item);
+            usage(1);
+        }
+    }
+    if (options.log_file == NULL) {
+        fprintf(stderr, "Error: missing event log\n");
+        usage(1);
+    }
+    if (options.every < 1) options.every = 1;
+    return options;
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    const Options options = collect_args(argv);
+    Log log;
+    load_log(options.log_file, &log);
+
+    if (options.iteration >= 0) {
+        int upto = options.iteration < log.circles ? options.iteration : log.circles;
+        // Stamp up to the upto-th circle along with the blocks before it, or
+        // everything when that is the last one
+        int i = 0, last = -1;
+        for (int n = 0; i < log.count && (n < upto || upto == log.circles); i++) {
+            stamp(&log, &log.events[i]);
+            if (!log.events[i].block && ++n == upto) last = i;
+        }
+        display_ascii(&log);
+        if (last >= 0) display_event(&log, last, upto);
+        display_totals(&log, i, upto);
+        return 0;
+    }
+
+    display_ascii(&log);
+    for (int i = 0, n = 0; i < log.count; i++) {
+        stamp(&log, &log.events[i]);
+        const bool end = i + 1 == log.count;
+        if (!log.events[i].block) n++;
+        else if (!end) continue;
+        if (n % options.every != 0 && !end) continue;
+        sleep_frame(options.fps);
+        display_ascii(&log);
+        if (!log.events[i].block) display_event(&log, i, n);
+        fflush(stdout);
+    }
+    display_totals(&log, log.count, log.circles);
+    free(log.mask);
+    free(log.events);
+}